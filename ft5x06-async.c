@@ -0,0 +1,712 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Non-blocking operations driven from the caller's poll loop
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "ft5x06.h"
+
+#define ASYNC_LOCK_RETRY_MS	5
+#define ASYNC_STATUS_POLL_MS	5
+#define ASYNC_STATUS_TRIES	5
+#define ASYNC_READ_PACE_MS	10
+#define ASYNC_PROGRAM_DONE_MS	50
+#define ASYNC_RESET_FW_MS	100
+
+/*
+ * Every msleep() of the blocking procedures becomes a deadline on the
+ * timer fd, the step after it runs from the next dispatch.
+ */
+enum async_state {
+	AS_IDLE,
+	AS_SIMPLE,		/* detect and register reads */
+	AS_LOCK,
+	AS_RESET_AA,
+	AS_RESET_55,
+	AS_HID,
+	AS_ENTER,
+	AS_READ_ID,
+	AS_ERASE,
+	AS_ERASE_WAIT,
+	AS_SET_LEN,
+	AS_WRITE_PKT,
+	AS_POLL_PKT,
+	AS_VERIFY,
+	AS_READ_PKT,
+	AS_RESET_FW,
+	AS_DONE,
+};
+
+struct ft5x06_async {
+	int fd;
+	int addr;
+	int tfd;
+	ft5x06_async_cb cb;
+	void *priv;
+
+	enum async_state state;
+	uint64_t deadline_ns;
+	struct ft5x06_async_event ev;
+	struct ft5x06_fw_update_info *info;
+	struct ft5x06_fw_update_info family;	/* flash size overridden */
+	int chip_id;
+	bool locked;		/* bus held, upgrade mode may be entered */
+	int attempt;
+	int tries;
+	int interval;		/* erase status polls, ms */
+	uint64_t erase_ns;
+	uint8_t reg;
+	uint8_t ecc;
+	uint32_t offset;
+	uint32_t size;
+	const uint8_t *img;
+	int outfd;
+};
+
+struct ft5x06_async *ft5x06_async_new(int fd, int addr, ft5x06_async_cb cb,
+				      void *priv)
+{
+	struct ft5x06_async *a = calloc(1, sizeof(*a));
+
+	if (!a)
+		return NULL;
+
+	a->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (a->tfd < 0) {
+		ERR("Couldn't create timer: %s", strerror(errno));
+		free(a);
+		return NULL;
+	}
+	a->fd = fd;
+	a->addr = addr;
+	a->cb = cb;
+	a->priv = priv;
+
+	return a;
+}
+
+/* An operation still running is abandoned, the bus lock released */
+void ft5x06_async_free(struct ft5x06_async *a)
+{
+	if (!a)
+		return;
+
+	if (a->locked)
+		ft5x06_bus_unlock(a->fd);
+	close(a->tfd);
+	free(a);
+}
+
+/* Readable (POLLIN) when ft5x06_async_dispatch() has work to do */
+int ft5x06_async_fd(struct ft5x06_async *a)
+{
+	return a->tfd;
+}
+
+/* For loops without fds, -1 when idle as poll() expects */
+int ft5x06_async_timeout_ms(struct ft5x06_async *a)
+{
+	uint64_t now = ft5x06_now_ns();
+
+	if (a->state == AS_IDLE)
+		return -1;
+	if (a->deadline_ns <= now)
+		return 0;
+
+	return (a->deadline_ns - now + 999999) / 1000000;
+}
+
+static void async_schedule(struct ft5x06_async *a, int ms)
+{
+	struct itimerspec its = { { 0 } };
+
+	a->deadline_ns = ft5x06_now_ns() + ms * 1000000ull;
+	its.it_value.tv_sec = a->deadline_ns / 1000000000ull;
+	its.it_value.tv_nsec = a->deadline_ns % 1000000000ull;
+	timerfd_settime(a->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void async_progress(struct ft5x06_async *a, const char *stage)
+{
+	a->ev.stage = stage;
+	if (a->cb)
+		a->cb(a, &a->ev, a->priv);
+}
+
+/* Last thing done, the callback may submit the next operation */
+static void async_complete(struct ft5x06_async *a, int ret)
+{
+	struct ft5x06_async_event ev = a->ev;
+	struct itimerspec its = { { 0 } };
+
+	timerfd_settime(a->tfd, 0, &its, NULL);
+	a->state = AS_IDLE;
+	ev.complete = true;
+	ev.ret = ret;
+	if (a->cb)
+		a->cb(a, &ev, a->priv);
+}
+
+static int async_submit(struct ft5x06_async *a, enum ft5x06_async_op op,
+			enum async_state state)
+{
+	if (a->state != AS_IDLE)
+		return -EBUSY;
+
+	memset(&a->ev, 0, sizeof(a->ev));
+	a->ev.op = op;
+	a->state = state;
+	a->attempt = 0;
+	a->offset = 0;
+	async_schedule(a, 0);
+
+	return 0;
+}
+
+int ft5x06_async_detect(struct ft5x06_async *a)
+{
+	return async_submit(a, FT_ASYNC_DETECT, AS_SIMPLE);
+}
+
+/*
+ * Parameters are only stored once the submission is accepted, a busy
+ * handle keeps those of the operation in flight.
+ */
+int ft5x06_async_read_reg(struct ft5x06_async *a, uint8_t reg)
+{
+	int ret = async_submit(a, FT_ASYNC_READ_REG, AS_SIMPLE);
+
+	if (ret == 0)
+		a->reg = reg;
+	return ret;
+}
+
+static int async_upgrade(struct ft5x06_async *a, enum ft5x06_async_op op,
+			 int chip_id, uint32_t size)
+{
+	struct ft5x06_fw_update_info info;
+	int ret;
+
+	if (a->state != AS_IDLE)
+		return -EBUSY;
+	if (ft5x06_get_flash_info(chip_id, &info) < 0)
+		return -ENODEV;
+	/* A size of 0 is the whole flash */
+	if (!size)
+		size = info.fw_max_size;
+	if (size > info.fw_max_size ||
+	    (info.addr_width < 3 && size > 0x10000)) {
+		ERR("%u bytes out of %s flash (%u bytes)", size,
+		    info.fts_name, info.fw_max_size);
+		return -EFBIG;
+	}
+
+	ret = async_submit(a, op, AS_LOCK);
+	if (ret < 0)
+		return ret;
+	a->family = info;
+	a->info = &a->family;
+	a->chip_id = chip_id;
+	a->size = size;
+	return 0;
+}
+
+/* A size of 0 reads the whole flash of the family */
+int ft5x06_async_dump(struct ft5x06_async *a, int chip_id, int outfd,
+		      uint32_t size)
+{
+	int ret = async_upgrade(a, FT_ASYNC_DUMP, chip_id, size);
+
+	if (ret == 0)
+		a->outfd = outfd;
+	return ret;
+}
+
+/* Erase, program and verify, img must stay valid until completion */
+int ft5x06_async_flash(struct ft5x06_async *a, int chip_id,
+		       const uint8_t *img, uint32_t len)
+{
+	int ret;
+
+	if (len < FT_FW_MIN_SIZE)
+		return -EINVAL;
+
+	ret = async_upgrade(a, FT_ASYNC_FLASH, chip_id, len);
+	if (ret == 0)
+		a->img = img;
+	return ret;
+}
+
+static int async_simple(struct ft5x06_async *a)
+{
+	uint8_t reg = a->ev.op == FT_ASYNC_DETECT ? ID_G_CIPHER : a->reg;
+	int ret;
+
+	ret = ft5x06_read_regs(a->fd, a->addr, reg, &a->ev.value, 1);
+	if (ret < 0 || a->ev.op != FT_ASYNC_DETECT)
+		return ret;
+
+	a->ev.chip_id = a->ev.value;
+	if (!ft5x06_get_name(a->ev.chip_id))
+		return -ENODEV;
+
+	return ft5x06_read_regs(a->fd, a->addr, ID_G_FIRMID, &a->ev.value, 1);
+}
+
+/* Another upgrade mode attempt, as ft5x06_init_upgrade() loops */
+static int async_retry(struct ft5x06_async *a)
+{
+	if (++a->attempt >= FT_UPGRADE_LOOP)
+		return -EIO;
+
+	a->state = AS_RESET_AA;
+	return 0;
+}
+
+static int async_write_pkt(struct ft5x06_async *a)
+{
+	uint8_t buf[FT_FW_PKT_LEN + FT_FW_PKT_META_LEN];
+	uint32_t len = a->size - a->offset;
+	int i;
+
+	if (len > FT_FW_PKT_LEN)
+		len = FT_FW_PKT_LEN;
+
+	buf[0] = FT_FW_START_REG;
+	ft5x06_fw_put_offset(&buf[1], a->offset, a->info->addr_width);
+	buf[4] = (uint8_t)(len >> 8);
+	buf[5] = (uint8_t)len;
+	for (i = 0; i < len; i++) {
+		buf[FT_FW_PKT_META_LEN + i] = a->img[a->offset + i];
+		a->ecc ^= a->img[a->offset + i];
+	}
+	a->tries = 0;
+
+	return ft5x06_i2c_write(a->fd, a->addr, buf, len + FT_FW_PKT_META_LEN);
+}
+
+static int async_read_pkt(struct ft5x06_async *a)
+{
+	uint8_t cmd[4], data[FT_FW_PKT_READ_LEN];
+	uint32_t len = a->size - a->offset;
+	int ret;
+
+	if (len > FT_FW_PKT_READ_LEN)
+		len = FT_FW_PKT_READ_LEN;
+
+	cmd[0] = FT_FW_READ_REG;
+	ft5x06_fw_put_offset(&cmd[1], a->offset, a->info->addr_width);
+	ret = ft5x06_i2c_read(a->fd, a->addr, cmd, sizeof(cmd), data, len);
+	if (ret < 0)
+		return ret;
+	if (write(a->outfd, data, len) != len)
+		return -errno;
+
+	a->offset += len;
+	return 0;
+}
+
+/*
+ * Runs one step of the operation and returns the delay before the next
+ * one in ms, or a negative error.
+ */
+static int async_step(struct ft5x06_async *a)
+{
+	uint8_t buf[4], val[2] = { 0 };
+	bool done;
+	int ret;
+
+	switch (a->state) {
+	case AS_SIMPLE:
+		/* Held around the reads, their own lock then only nests */
+		if (ft5x06_bus_trylock(a->fd) < 0)
+			return ASYNC_LOCK_RETRY_MS;
+		ret = async_simple(a);
+		ft5x06_bus_unlock(a->fd);
+		async_complete(a, ret < 0 ? ret : 0);
+		return 0;
+
+	case AS_LOCK:
+		if (ft5x06_bus_trylock(a->fd) < 0)
+			return ASYNC_LOCK_RETRY_MS;
+		a->locked = true;
+		a->ev.total = a->size;
+		async_progress(a, "enter");
+		a->state = AS_RESET_AA;
+		return 0;
+
+	case AS_RESET_AA:
+		ft5x06_write_reg(a->fd, a->addr, FT_RST_CMD_REG1,
+				 FT_UPGRADE_AA);
+		a->state = AS_RESET_55;
+		return a->info->delay_aa;
+
+	case AS_RESET_55:
+		ft5x06_write_reg(a->fd, a->addr, FT_RST_CMD_REG1,
+				 FT_UPGRADE_55);
+		a->state = a->chip_id == FT5x26_ID ? AS_HID : AS_ENTER;
+		return a->info->delay_55;
+
+	case AS_HID:
+		buf[0] = 0xeb;
+		buf[1] = 0xaa;
+		buf[2] = 0x09;
+		ft5x06_i2c_write(a->fd, a->addr, buf, 3);
+		ft5x06_i2c_read(a->fd, a->addr, buf, 0, buf, 3);
+		a->state = AS_ENTER;
+		return 10;
+
+	case AS_ENTER:
+		buf[0] = FT_UPGRADE_55;
+		buf[1] = FT_UPGRADE_AA;
+		if (ft5x06_i2c_write(a->fd, a->addr, buf, 2) < 0)
+			return async_retry(a);
+		a->state = AS_READ_ID;
+		return a->info->delay_readid;
+
+	case AS_READ_ID:
+		buf[0] = FT_READ_ID_REG;
+		buf[1] = buf[2] = buf[3] = 0x00;
+		ft5x06_i2c_read(a->fd, a->addr, buf, 4, val, 2);
+		if (val[0] != a->info->upgrade_id_1 ||
+		    val[1] != a->info->upgrade_id_2) {
+			ERR("READ-ID not ok: %x %x", val[0], val[1]);
+			return async_retry(a);
+		}
+		if (a->ev.op == FT_ASYNC_DUMP) {
+			async_progress(a, "dump");
+			a->state = AS_READ_PKT;
+			return ASYNC_READ_PACE_MS;
+		}
+		async_progress(a, "erase");
+		a->state = AS_ERASE;
+		return 0;
+
+	case AS_ERASE:
+		buf[0] = FT_ERASE_APP_REG;
+		ft5x06_i2c_write(a->fd, a->addr, buf, 1);
+		if (a->chip_id != FT5x26_ID) {
+			buf[0] = FT_ERASE_PANEL_REG;
+			ft5x06_i2c_write(a->fd, a->addr, buf, 1);
+		}
+		a->ecc = 0;
+		a->erase_ns = ft5x06_now_ns();
+		a->interval = FT_ERASE_POLL_MIN_MS;
+		a->state = AS_ERASE_WAIT;
+		return a->interval;
+
+	case AS_ERASE_WAIT:
+		ret = (ft5x06_now_ns() - a->erase_ns) / 1000000;
+		done = ft5x06_erase_done(a->fd, a->addr);
+		if (!done && ret < a->info->delay_erase_flash) {
+			a->interval = a->interval * 3 / 2;
+			if (a->interval > FT_ERASE_POLL_MAX_MS)
+				a->interval = FT_ERASE_POLL_MAX_MS;
+			if (a->interval > a->info->delay_erase_flash - ret)
+				return a->info->delay_erase_flash - ret;
+			return a->interval;
+		}
+		LOG("%s erase %s in %d ms (limit %u ms)", a->info->fts_name,
+		    done ? "done" : "not reported",
+		    ret, a->info->delay_erase_flash);
+		a->state = AS_SET_LEN;
+		return 0;
+
+	case AS_SET_LEN:
+		buf[0] = 0xB0;
+		buf[1] = (uint8_t)(a->size >> 16);
+		buf[2] = (uint8_t)(a->size >> 8);
+		buf[3] = (uint8_t)a->size;
+		ft5x06_i2c_write(a->fd, a->addr, buf, 4);
+		async_progress(a, "program");
+		a->state = AS_WRITE_PKT;
+		return 0;
+
+	case AS_WRITE_PKT:
+		ret = async_write_pkt(a);
+		if (ret < 0)
+			return ret;
+		a->state = AS_POLL_PKT;
+		return ASYNC_STATUS_POLL_MS;
+
+	case AS_POLL_PKT:
+		buf[0] = FT_FLASH_STATUS;
+		ft5x06_i2c_read(a->fd, a->addr, buf, 1, val, 2);
+		if (((val[0] << 8) | val[1]) != 0x1000 + a->offset /
+		    FT_FW_PKT_LEN && ++a->tries < ASYNC_STATUS_TRIES)
+			return ASYNC_STATUS_POLL_MS;
+
+		a->offset += FT_FW_PKT_LEN;
+		if (a->offset > a->size)
+			a->offset = a->size;
+		a->ev.done = a->offset;
+		async_progress(a, "program");
+		if (a->offset < a->size) {
+			a->state = AS_WRITE_PKT;
+			return 0;
+		}
+		a->state = AS_VERIFY;
+		return ASYNC_PROGRAM_DONE_MS;
+
+	case AS_VERIFY:
+		async_progress(a, "verify");
+		buf[0] = FT_REG_ECC;
+		ft5x06_i2c_read(a->fd, a->addr, buf, 1, val, 1);
+		if (val[0] != a->ecc) {
+			ERR("ECC error %02x vs. %02x", val[0], a->ecc);
+			return -EIO;
+		}
+		a->state = AS_RESET_FW;
+		return 0;
+
+	case AS_READ_PKT:
+		ret = async_read_pkt(a);
+		if (ret < 0)
+			return ret;
+		a->ev.done = a->offset;
+		async_progress(a, "dump");
+		if (a->offset < a->size)
+			return ASYNC_READ_PACE_MS;
+		a->state = AS_RESET_FW;
+		return 0;
+
+	case AS_RESET_FW:
+		async_progress(a, "reset");
+		buf[0] = FT_REG_RESET_FW;
+		ft5x06_i2c_write(a->fd, a->addr, buf, 1);
+		ft5x06_bus_unlock(a->fd);
+		a->locked = false;
+		a->state = AS_DONE;
+		return ASYNC_RESET_FW_MS;
+
+	case AS_DONE:
+		async_complete(a, a->ev.ret);
+		return 0;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Call when the fd polls readable or the timeout expired. Each call runs
+ * at most one step, whose I2C transfers are the only blocking part (a
+ * packet, about 4 ms at 400 kHz).
+ */
+int ft5x06_async_dispatch(struct ft5x06_async *a)
+{
+	uint64_t expirations;
+	int delay;
+
+	if (read(a->tfd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		return -errno;
+	if (a->state == AS_IDLE || ft5x06_now_ns() < a->deadline_ns)
+		return 0;
+
+	delay = async_step(a);
+	if (a->state == AS_IDLE)
+		return 0;
+
+	if (delay < 0) {
+		/* Leave upgrade mode in any case, the error is kept */
+		a->ev.ret = delay;
+		if (!a->locked) {
+			async_complete(a, delay);
+			return 0;
+		}
+		a->state = AS_RESET_FW;
+		delay = 0;
+	}
+	async_schedule(a, delay);
+
+	return 0;
+}
+
+/* Demonstration host: a single poll() loop around the operations */
+#define ASYNC_RUN_STEPS		3
+
+struct async_run {
+	int chip_id;
+	const char *input;
+	const char *output;
+	int outfd;
+	uint8_t *img;
+	uint32_t len;
+	bool busy;
+	int ret;
+	int reported;
+};
+
+static void async_run_cb(struct ft5x06_async *a,
+			 const struct ft5x06_async_event *ev, void *priv)
+{
+	static const char * const ops[] = { "detect", "read", "dump", "flash" };
+	struct async_run *r = priv;
+	int pct = ev->total ? 100ull * ev->done / ev->total : 0;
+
+	if (!ev->complete) {
+		if (pct / 10 != r->reported / 10 || pct == 0 || pct == 100)
+			DBG("%s: %s %u/%u", ops[ev->op], ev->stage, ev->done,
+			    ev->total);
+		r->reported = pct;
+		return;
+	}
+
+	r->busy = false;
+	r->ret = ev->ret;
+	if (ev->ret < 0) {
+		ERR("Asynchronous %s failed (%d)", ops[ev->op], ev->ret);
+		return;
+	}
+
+	switch (ev->op) {
+	case FT_ASYNC_DETECT:
+		LOG("Detected %s, firmware version %d.0.0",
+		    ft5x06_get_name(ev->chip_id), ev->value);
+		break;
+	case FT_ASYNC_DUMP:
+		LOG("Dumped %u bytes to %s", ev->done, r->output);
+		break;
+	case FT_ASYNC_FLASH:
+		LOG("Flashed %u bytes from %s", ev->done, r->input);
+		break;
+	default:
+		break;
+	}
+}
+
+static int async_run_next(struct ft5x06_async *a, struct async_run *r,
+			  int step)
+{
+	switch (step) {
+	case 0:
+		return ft5x06_async_detect(a);
+	case 1:
+		if (!r->output)
+			return 1;
+		return ft5x06_async_dump(a, r->chip_id, r->outfd, 0);
+	case 2:
+		if (!r->input)
+			return 1;
+		return ft5x06_async_flash(a, r->chip_id, r->img, r->len);
+	default:
+		return 1;
+	}
+}
+
+static int async_run_open(struct async_run *r)
+{
+	struct stat sb;
+	int infd;
+
+	if (r->output) {
+		r->outfd = open(r->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (r->outfd < 0) {
+			ERR("Unable to open file %s", r->output);
+			return -errno;
+		}
+	}
+	if (!r->input)
+		return 0;
+
+	infd = open(r->input, O_RDONLY);
+	if (infd < 0 || fstat(infd, &sb) < 0) {
+		ERR("Unable to open file %s", r->input);
+		if (infd >= 0)
+			close(infd);
+		return -ENOENT;
+	}
+	r->img = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, infd, 0);
+	close(infd);
+	if (r->img == MAP_FAILED) {
+		r->img = NULL;
+		ERR("Couldn't map: %s", strerror(errno));
+		return -errno;
+	}
+	r->len = sb.st_size;
+
+	return 0;
+}
+
+/*
+ * Detect, then dump and/or flash, all through the asynchronous API. The
+ * longest dispatch shows how long the host loop could be held up.
+ */
+int ft5x06_async_run(int fd, int addr, int chip_id, const char *input,
+		     const char *output)
+{
+	struct async_run r = {
+		.chip_id = chip_id,
+		.input = input,
+		.output = output,
+		.outfd = -1,
+	};
+	struct ft5x06_async *a;
+	struct ft5x06_lat lat;
+	uint64_t t0, busy_ns = 0;
+	int step = 0, ret;
+
+	ret = async_run_open(&r);
+	a = ret < 0 ? NULL : ft5x06_async_new(fd, addr, async_run_cb, &r);
+	if (!a) {
+		ret = ret < 0 ? ret : -ENOMEM;
+		goto out;
+	}
+	ft5x06_lat_init(&lat, 65536);
+
+	t0 = ft5x06_now_ns();
+	while (r.ret == 0) {
+		struct pollfd pfd = { ft5x06_async_fd(a), POLLIN, 0 };
+		uint64_t t;
+
+		if (!r.busy) {
+			if (step >= ASYNC_RUN_STEPS)
+				break;
+			ret = async_run_next(a, &r, step++);
+			if (ret > 0)
+				continue;
+			if (ret < 0) {
+				r.ret = ret;
+				break;
+			}
+			r.busy = true;
+		}
+
+		if (poll(&pfd, 1, ft5x06_async_timeout_ms(a)) < 0 &&
+		    errno != EINTR) {
+			r.ret = -errno;
+			break;
+		}
+		t = ft5x06_now_ns();
+		ft5x06_async_dispatch(a);
+		t = ft5x06_now_ns() - t;
+		busy_ns += t;
+		ft5x06_lat_add(&lat, t);
+	}
+	ret = r.ret;
+
+	t0 = ft5x06_now_ns() - t0;
+	LOG("Loop busy %.1f ms of %.1f ms (%.2f%%) over %u dispatches",
+	    busy_ns / 1e6, t0 / 1e6, 100.0 * busy_ns / t0, lat.count);
+	ft5x06_lat_report(&lat, "dispatch");
+	ft5x06_lat_free(&lat);
+	ft5x06_async_free(a);
+out:
+	if (r.img)
+		munmap(r.img, r.len);
+	if (r.outfd >= 0)
+		close(r.outfd);
+	return ret;
+}
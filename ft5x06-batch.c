@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Batch mode: a stream of commands run against buses kept open
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ft5x06.h"
+
+#define BATCH_MAX_BUSES		8
+#define BATCH_MAX_TARGETS	16
+#define BATCH_MAX_DATA		32
+#define BATCH_MAX_ARGS		(2 + BATCH_MAX_DATA)	/* write reg bytes */
+
+/* Controller identity, read once per bus and address */
+struct batch_target {
+	int bus;
+	int addr;
+	int chip_id;		/* -1 until detected */
+	int fw;			/* -1 until read, or after a flash */
+};
+
+static struct {
+	FILE *out;
+	int emul_fd;		/* emulated controller, no bus to open */
+	int nbuses;
+	struct {
+		int bus;
+		int fd;
+	} buses[BATCH_MAX_BUSES];
+	int ntargets;
+	struct batch_target targets[BATCH_MAX_TARGETS];
+	struct batch_target *cur;
+	int fd;
+} batch;
+
+static int batch_fd(int bus)
+{
+	int i;
+
+	for (i = 0; i < batch.nbuses; i++)
+		if (batch.buses[i].bus == bus)
+			return batch.buses[i].fd;
+
+	return -1;
+}
+
+/* Buses stay open until the end of the stream */
+static int batch_open(int bus, int addr)
+{
+	char dev[24];
+	int fd = batch_fd(bus);
+
+	if (fd >= 0)
+		return fd;
+	if (batch.nbuses >= BATCH_MAX_BUSES)
+		return -ENOSPC;
+
+	snprintf(dev, sizeof(dev), "/dev/i2c-%d", bus);
+	fd = open(dev, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ERR("Couldn't open %s: %s", dev, strerror(errno));
+		return -errno;
+	}
+	if (ioctl(fd, I2C_SLAVE_FORCE, addr) != 0) {
+		ERR("Couldn't set slave addr: %s", strerror(errno));
+		close(fd);
+		return -errno;
+	}
+	ft5x06_bus_lock_register(fd, bus);
+
+	batch.buses[batch.nbuses].bus = bus;
+	batch.buses[batch.nbuses].fd = fd;
+	batch.nbuses++;
+
+	return fd;
+}
+
+static int batch_select(int bus, int addr)
+{
+	struct batch_target *t;
+	int i, fd;
+
+	fd = bus < 0 ? batch.emul_fd : batch_open(bus, addr);
+	if (bus >= 0 && fd < 0)
+		return fd;
+
+	for (i = 0; i < batch.ntargets; i++) {
+		t = &batch.targets[i];
+		if (t->bus == bus && t->addr == addr)
+			break;
+	}
+	if (i >= batch.ntargets) {
+		if (batch.ntargets >= BATCH_MAX_TARGETS)
+			return -ENOSPC;
+		t = &batch.targets[batch.ntargets++];
+		t->bus = bus;
+		t->addr = addr;
+		t->chip_id = -1;
+		t->fw = -1;
+	}
+
+	batch.cur = t;
+	batch.fd = fd;
+	return 0;
+}
+
+static int batch_identify(struct batch_target *t, bool force)
+{
+	uint8_t val;
+	int ret;
+
+	if (force || t->chip_id < 0) {
+		ret = ft5x06_read_regs(batch.fd, t->addr, ID_G_CIPHER, &val, 1);
+		if (ret < 0)
+			return ret;
+		if (!ft5x06_get_name(val)) {
+			ERR("Unsupported chip ID: %x", val);
+			return -ENODEV;
+		}
+		t->chip_id = val;
+	}
+	if (force || t->fw < 0) {
+		ret = ft5x06_read_regs(batch.fd, t->addr, ID_G_FIRMID, &val, 1);
+		if (ret < 0)
+			return ret;
+		t->fw = val;
+	}
+
+	return 0;
+}
+
+static int batch_num(const char *s, int base, long min, long max, long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtol(s, &end, base);
+	if (errno || *end != '\0' || *val < min || *val > max)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Runs one command, its result fields go to res. Returns 0 or a negative
+ * error.
+ */
+static int batch_cmd(int argc, char **argv, char *res, int size)
+{
+	struct batch_target *t = batch.cur;
+	uint8_t buf[BATCH_MAX_DATA];
+	struct ft5x06_job jobs[FT_JOB_MAX];
+	long v, n;
+	int i, len, fd, ret;
+
+	if (strcmp(argv[0], "bus") == 0 && argc >= 2) {
+		if (batch_num(argv[1], 10, 0, 255, &v) < 0)
+			return -EINVAL;
+		if (t->bus < 0) {
+			ERR("Emulated controller, no bus to select");
+			return -ENODEV;
+		}
+		return batch_select(v, t->addr);
+	}
+
+	if (strcmp(argv[0], "addr") == 0 && argc >= 2) {
+		if (batch_num(argv[1], 16, 0x03, 0x77, &v) < 0)
+			return -EINVAL;
+		return batch_select(t->bus, v);
+	}
+
+	if (strcmp(argv[0], "probe") == 0) {
+		ret = batch_identify(t, true);
+		if (ret == 0)
+			snprintf(res, size, " chip=%#x name=%s fw=%d",
+				 t->chip_id, ft5x06_get_name(t->chip_id),
+				 t->fw);
+		return ret;
+	}
+
+	if (strcmp(argv[0], "read") == 0 && argc >= 2) {
+		n = 1;
+		if (batch_num(argv[1], 16, 0, 0xff, &v) < 0 ||
+		    (argc >= 3 && batch_num(argv[2], 10, 1, sizeof(buf), &n)))
+			return -EINVAL;
+		ret = ft5x06_read_regs(batch.fd, t->addr, v, buf, n);
+		if (ret < 0)
+			return ret;
+		len = snprintf(res, size, " reg=%#04lx data=", v);
+		for (i = 0; i < n && len < size; i++)
+			len += snprintf(res + len, size - len, "%02x", buf[i]);
+		return 0;
+	}
+
+	if (strcmp(argv[0], "write") == 0 && argc >= 3) {
+		if (batch_num(argv[1], 16, 0, 0xff, &v) < 0)
+			return -EINVAL;
+		for (i = 2; i < argc; i++) {
+			if (batch_num(argv[i], 16, 0, 0xff, &n) < 0)
+				return -EINVAL;
+			buf[i - 2] = n;
+		}
+		ret = ft5x06_write_regs(batch.fd, t->addr, v, buf, argc - 2);
+		if (ret < 0)
+			return ret;
+		snprintf(res, size, " reg=%#04lx len=%d", v, argc - 2);
+		return 0;
+	}
+
+	if (strcmp(argv[0], "sleep") == 0 && argc >= 2) {
+		if (batch_num(argv[1], 10, 0, 60000, &v) < 0)
+			return -EINVAL;
+		msleep(v);
+		return 0;
+	}
+
+	/* Upgrade mode operations, on the cached identity */
+	if (strcmp(argv[0], "dump") == 0 && argc >= 2) {
+		struct ft5x06_session s;
+
+		n = 0;
+		if (argc >= 3 && batch_num(argv[2], 0, 1, 0x1000000, &n) < 0)
+			return -EINVAL;
+		ret = batch_identify(t, false);
+		if (ret < 0)
+			return ret;
+		fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			ERR("Unable to open file %s", argv[1]);
+			return -errno;
+		}
+		ret = ft5x06_session_begin(&s, batch.fd, t->addr, t->chip_id);
+		if (ret == 0) {
+			ret = ft5x06_session_dump(&s, fd, n);
+			ft5x06_session_end(&s);
+		}
+		close(fd);
+		return ret;
+	}
+
+	if ((strcmp(argv[0], "flash") == 0 || strcmp(argv[0], "job") == 0) &&
+	    argc >= 2) {
+		ret = batch_identify(t, false);
+		if (ret < 0)
+			return ret;
+		if (argv[0][0] == 'f') {
+			jobs[0] = (struct ft5x06_job){ FT_JOB_ERASE };
+			jobs[1] = (struct ft5x06_job){ FT_JOB_PROGRAM,
+						       argv[1] };
+			jobs[2] = (struct ft5x06_job){ FT_JOB_VERIFY };
+			n = 3;
+		} else {
+			n = ft5x06_job_parse(argv[1], jobs, ARRAY_SIZE(jobs));
+			if (n < 0)
+				return n;
+		}
+		ret = ft5x06_job_run(batch.fd, t->addr, t->chip_id, jobs, n);
+		/* The firmware may have changed */
+		t->fw = -1;
+		return ret;
+	}
+
+	if (strcmp(argv[0], "selftest") == 0 && argc >= 2) {
+		ret = ft5x06_selftest(batch.fd, t->addr, argv[1]);
+		if (ret >= 0)
+			snprintf(res, size, " failed=%d", ret);
+		return ret > 0 ? -EIO : ret;
+	}
+
+	ERR("Unknown or incomplete command %s", argv[0]);
+	return -EINVAL;
+}
+
+/*
+ * One command per line, '#' starts a comment:
+ *   bus 3
+ *   addr 38
+ *   probe
+ *   read a6 [count]
+ *   write 88 0c
+ *   dump backup.bin [size]
+ *   flash fw.bin
+ *   job erase,program=fw.bin,verify
+ *   selftest limits.txt
+ *   sleep 100
+ * Each command gets one line on stdout, "ok <command> [fields] ms=<time>"
+ * or "err <command> line=<n> code=<-errno> [fields] ms=<time>", logs go
+ * to stderr.
+ * Returns the number of failed commands, or a negative error if the
+ * stream couldn't be started.
+ */
+int ft5x06_batch_run(const char *path, int fd, int bus, int addr,
+		     int chip_id)
+{
+	FILE *in = stdin;
+	char *line = NULL, *argv[BATCH_MAX_ARGS], *save;
+	char res[256];
+	size_t size = 0;
+	int argc, lineno = 0, count = 0, failed = 0, ret;
+	uint64_t start = ft5x06_now_ns();
+
+	if (strcmp(path, "-") != 0) {
+		in = fopen(path, "r");
+		if (!in) {
+			ERR("Unable to open file %s", path);
+			return -ENOENT;
+		}
+	}
+
+	/* Results alone on stdout */
+	fflush(stdout);
+	batch.out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!batch.out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		if (in != stdin)
+			fclose(in);
+		return -errno;
+	}
+	setvbuf(batch.out, NULL, _IOLBF, 0);
+
+	batch.emul_fd = bus < 0 ? fd : -1;
+	if (bus >= 0) {
+		batch.buses[0].bus = bus;
+		batch.buses[0].fd = fd;
+		batch.nbuses = 1;
+	}
+	ret = batch_select(bus, addr);
+	if (ret < 0) {
+		failed = ret;
+		goto out;
+	}
+	batch.cur->chip_id = chip_id;
+
+	while (getline(&line, &size, in) > 0) {
+		char *hash = strchr(line, '#');
+		char *tok;
+		uint64_t t;
+
+		lineno++;
+		if (hash)
+			*hash = '\0';
+		argc = 0;
+		for (tok = strtok_r(line, " \t\r\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &save)) {
+			/* Counted past the end, the line is rejected below */
+			if (argc < BATCH_MAX_ARGS)
+				argv[argc] = tok;
+			argc++;
+		}
+		if (!argc)
+			continue;
+		if (strcmp(argv[0], "quit") == 0)
+			break;
+
+		count++;
+		res[0] = '\0';
+		t = ft5x06_now_ns();
+		if (argc > BATCH_MAX_ARGS) {
+			ERR("Line %d: too many arguments (max %d)", lineno,
+			    BATCH_MAX_ARGS - 1);
+			ret = -E2BIG;
+		} else {
+			ret = batch_cmd(argc, argv, res, sizeof(res));
+		}
+		t = ft5x06_now_ns() - t;
+		if (ret < 0) {
+			failed++;
+			fprintf(batch.out, "err %s line=%d code=%d%s ms=%.1f\n",
+				argv[0], lineno, ret, res, t / 1e6);
+		} else {
+			fprintf(batch.out, "ok %s%s ms=%.1f\n", argv[0], res,
+				t / 1e6);
+		}
+	}
+
+	LOG("%d commands, %d failed, %.1f ms", count, failed,
+	    (ft5x06_now_ns() - start) / 1e6);
+
+out:
+	/* The first bus belongs to the caller */
+	while (batch.nbuses > 1)
+		close(batch.buses[--batch.nbuses].fd);
+	fflush(stdout);
+	dup2(fileno(batch.out), STDOUT_FILENO);
+	fclose(batch.out);
+	free(line);
+	if (in != stdin)
+		fclose(in);
+
+	return failed;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Latency comparison between the kernel evdev path and direct I2C reads,
+ * flash throughput
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "ft5x06.h"
+
+/* One INT edge followed by our own read of the touch registers */
+struct bench_direct {
+	uint64_t edge_ns;
+	uint64_t read_ns;
+	uint16_t x;
+	uint16_t y;
+	uint8_t count;
+};
+
+/* One SYN_REPORT as seen by an evdev client */
+struct bench_evdev {
+	uint64_t kernel_ns;
+	uint64_t user_ns;
+	uint16_t x;
+	uint16_t y;
+};
+
+struct bench_ctx {
+	int evfd;
+	int cpu;
+	volatile bool stop;
+	struct bench_evdev *ev;
+	uint32_t ev_count;
+	uint32_t ev_size;
+};
+
+static void *bench_evdev_thread(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	struct input_event events[64];
+	struct pollfd pfd = { .fd = ctx->evfd, .events = POLLIN };
+	uint16_t x = 0, y = 0;
+	bool first_slot = true;
+
+	ft5x06_rt_setup(ctx->cpu);
+
+	while (!ctx->stop && ctx->ev_count < ctx->ev_size) {
+		ssize_t len;
+		uint64_t now;
+		int i;
+
+		/* Timeout only so that the stop flag gets noticed */
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		len = read(ctx->evfd, events, sizeof(events));
+		now = ft5x06_now_ns();
+		if (len < (ssize_t)sizeof(events[0]))
+			continue;
+
+		for (i = 0; i < len / sizeof(events[0]); i++) {
+			struct input_event *e = &events[i];
+			struct bench_evdev *rec;
+
+			if (e->type == EV_ABS) {
+				if (e->code == ABS_MT_SLOT)
+					first_slot = (e->value == 0);
+				else if (e->code == ABS_MT_POSITION_X &&
+					 first_slot)
+					x = e->value;
+				else if (e->code == ABS_MT_POSITION_Y &&
+					 first_slot)
+					y = e->value;
+				continue;
+			}
+
+			if (e->type != EV_SYN || e->code != SYN_REPORT ||
+			    ctx->ev_count >= ctx->ev_size)
+				continue;
+
+			rec = &ctx->ev[ctx->ev_count++];
+			rec->kernel_ns = e->input_event_sec * 1000000000ull +
+					 e->input_event_usec * 1000ull;
+			rec->user_ns = now;
+			rec->x = x;
+			rec->y = y;
+			first_slot = true;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Pairs every INT edge with the first evdev report stamped between that
+ * edge and the next one. Edges the kernel didn't report (e.g. release
+ * frames it filtered out) are simply left unmatched.
+ */
+static void bench_correlate(struct bench_direct *direct, uint32_t ndirect,
+			    struct bench_ctx *ctx)
+{
+	struct ft5x06_lat lat_direct = { 0 }, lat_kernel = { 0 };
+	struct ft5x06_lat lat_user = { 0 }, lat_extra = { 0 };
+	uint32_t i, j = 0, matched = 0, same_pos = 0;
+
+	if (ft5x06_lat_init(&lat_direct, ndirect) < 0 ||
+	    ft5x06_lat_init(&lat_kernel, ndirect) < 0 ||
+	    ft5x06_lat_init(&lat_user, ndirect) < 0 ||
+	    ft5x06_lat_init(&lat_extra, ndirect) < 0)
+		goto out;
+
+	for (i = 0; i < ndirect; i++) {
+		uint64_t start = direct[i].edge_ns;
+		uint64_t end = (i + 1 < ndirect) ? direct[i + 1].edge_ns :
+						   UINT64_MAX;
+
+		ft5x06_lat_add(&lat_direct, direct[i].read_ns - start);
+
+		while (j < ctx->ev_count && ctx->ev[j].kernel_ns < start)
+			j++;
+		if (j >= ctx->ev_count || ctx->ev[j].kernel_ns >= end)
+			continue;
+
+		matched++;
+		if (direct[i].count && ctx->ev[j].x == direct[i].x &&
+		    ctx->ev[j].y == direct[i].y)
+			same_pos++;
+		ft5x06_lat_add(&lat_kernel, ctx->ev[j].kernel_ns - start);
+		ft5x06_lat_add(&lat_user, ctx->ev[j].user_ns - start);
+		if (ctx->ev[j].user_ns > direct[i].read_ns)
+			ft5x06_lat_add(&lat_extra, ctx->ev[j].user_ns -
+				       direct[i].read_ns);
+		j++;
+	}
+
+	LOG("Frames: %u edges, %u evdev reports, %u matched, "
+	    "%u with identical position", ndirect, ctx->ev_count, matched,
+	    same_pos);
+	ft5x06_lat_report(&lat_direct, "INT -> direct read");
+	ft5x06_lat_report(&lat_kernel, "INT -> evdev timestamp");
+	ft5x06_lat_report(&lat_user, "INT -> evdev read()");
+	ft5x06_lat_report(&lat_extra, "evdev over direct");
+
+out:
+	ft5x06_lat_free(&lat_direct);
+	ft5x06_lat_free(&lat_kernel);
+	ft5x06_lat_free(&lat_user);
+	ft5x06_lat_free(&lat_extra);
+}
+
+int ft5x06_bench_evdev(int fd, int addr, int chip_id, const char *evdev,
+		       const char *gpio, int count, int cpu)
+{
+	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	struct ft5x06_touch_frame frame;
+	struct bench_direct *direct;
+	struct bench_ctx ctx;
+	pthread_t thread;
+	bool edge_events;
+	int clk = CLOCK_MONOTONIC;
+	int gfd, i, ret = 0;
+
+	if (info == NULL || !gpio || count <= 0)
+		return -EINVAL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.evfd = open(evdev, O_RDONLY | O_NONBLOCK);
+	if (ctx.evfd < 0) {
+		ERR("Couldn't open %s: %s", evdev, strerror(errno));
+		return -errno;
+	}
+	if (ioctl(ctx.evfd, EVIOCSCLOCKID, &clk) < 0)
+		ERR("Couldn't switch %s to CLOCK_MONOTONIC", evdev);
+
+	gfd = ft5x06_gpio_open(gpio, &edge_events);
+	if (gfd < 0) {
+		close(ctx.evfd);
+		return gfd;
+	}
+	LOG("INT edges from %s (%s)", gpio,
+	    edge_events ? "line events" : "busy sampling");
+
+	/* Everything the loops touch is allocated (and faulted) here */
+	direct = calloc(count, sizeof(*direct));
+	ctx.ev_size = count * 2;
+	ctx.ev = calloc(ctx.ev_size, sizeof(*ctx.ev));
+	if (!direct || !ctx.ev) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ctx.cpu = (cpu >= 0) ? cpu + 1 : -1;
+
+	ret = pthread_create(&thread, NULL, bench_evdev_thread, &ctx);
+	if (ret) {
+		ret = -ret;
+		goto out;
+	}
+
+	/* A busy sampling loop at SCHED_FIFO must not share its CPU */
+	if (edge_events || cpu >= 0)
+		ft5x06_rt_setup(cpu);
+	else
+		LOG("Busy sampling without --cpu, not switching to SCHED_FIFO");
+	/* Held throughout, arbitration isn't part of the measured path */
+	ft5x06_bus_lock(fd);
+	LOG("Capturing %d frames, touch the panel", count);
+	for (i = 0; i < count; i++) {
+		ret = ft5x06_gpio_wait(gfd, edge_events, FT_INT_IDLE_MS,
+				       &direct[i].edge_ns);
+		if (ret == -ETIMEDOUT)
+			LOG("No touch for %d s, stopping",
+			    FT_INT_IDLE_MS / 1000);
+		if (ret < 0)
+			break;
+
+		ret = ft5x06_read_touch(fd, addr, &frame,
+					info->tpd_max_points);
+		direct[i].read_ns = frame.ts;
+		if (ret > 0) {
+			direct[i].count = frame.count;
+			direct[i].x = frame.p[0].x;
+			direct[i].y = frame.p[0].y;
+		}
+	}
+	ft5x06_bus_unlock(fd);
+
+	/* Leave the kernel path some time to deliver the last report */
+	msleep(100);
+	ctx.stop = true;
+	pthread_join(thread, NULL);
+
+	bench_correlate(direct, i, &ctx);
+	ret = 0;
+out:
+	free(direct);
+	free(ctx.ev);
+	close(gfd);
+	close(ctx.evfd);
+	return ret;
+}
+
+static long bench_maxrss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+/* Temporary image of pseudo-random content, written in fixed chunks */
+static int bench_flash_image(uint32_t size)
+{
+	uint8_t chunk[FT_FW_STREAM_CHUNK];
+	uint32_t seed = size, done, i;
+	FILE *f = tmpfile();
+	int fd;
+
+	if (!f)
+		return -errno;
+
+	for (done = 0; done < size; done += sizeof(chunk)) {
+		for (i = 0; i < sizeof(chunk); i++) {
+			seed = seed * 1103515245 + 12345;
+			chunk[i] = seed >> 16;
+		}
+		if (fwrite(chunk, 1, sizeof(chunk), f) != sizeof(chunk)) {
+			fclose(f);
+			return -EIO;
+		}
+	}
+	fflush(f);
+
+	/* The descriptor outlives the stream, the file goes with its close */
+	fd = dup(fileno(f));
+	fclose(f);
+	return fd < 0 ? -errno : fd;
+}
+
+/*
+ * Program/verify/dump throughput on large images, meant to be run against
+ * the emulator (--emulate with --flash-size) to validate the 3-byte
+ * addressing path and check that memory use doesn't grow with the image.
+ */
+int ft5x06_bench_flash(int fd, int addr, int chip_id)
+{
+	static const uint32_t sizes_kb[] = { 64, 128, 192, 256 };
+	struct ft5x06_fw_update_info info;
+	struct ft5x06_session s;
+	int i, ret = 0;
+
+	if (ft5x06_get_flash_info(chip_id, &info) < 0)
+		return -ENODEV;
+
+	for (i = 0; i < ARRAY_SIZE(sizes_kb); i++) {
+		uint32_t size = sizes_kb[i] * 1024;
+		uint64_t t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+		int img, null;
+
+		if (size > info.fw_max_size)
+			break;
+
+		img = bench_flash_image(size);
+		null = open("/dev/null", O_WRONLY);
+		if (img < 0 || null < 0) {
+			ret = -EIO;
+			break;
+		}
+
+		ret = ft5x06_session_begin(&s, fd, addr, chip_id);
+		if (ret == 0) {
+			ret = ft5x06_session_erase(&s);
+			t0 = ft5x06_now_ns();
+			if (ret == 0)
+				ret = ft5x06_session_program_fd(&s, img, size);
+			t1 = ft5x06_now_ns();
+			if (ret == 0)
+				ret = ft5x06_session_verify(&s);
+			t2 = ft5x06_now_ns();
+			if (ret == 0)
+				ret = ft5x06_session_dump(&s, null, size);
+			t3 = ft5x06_now_ns();
+			ft5x06_session_end(&s);
+		}
+		close(img);
+		close(null);
+		if (ret < 0) {
+			ERR("%u KiB image failed (%d)", sizes_kb[i], ret);
+			break;
+		}
+
+		LOG("%3u KiB: program %.1f KiB/s, verify %.1f ms, "
+		    "dump %.1f KiB/s, max RSS %ld KiB", sizes_kb[i],
+		    sizes_kb[i] / ((t1 - t0) / 1e9), (t2 - t1) / 1e6,
+		    sizes_kb[i] / ((t3 - t2) / 1e9), bench_maxrss_kb());
+	}
+
+	return ret;
+}
@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Long raw data captures in a compact delta encoded file
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ft5x06.h"
+
+/*
+ * File layout, little endian:
+ *  - block 0: struct cap_header, rest of the block unused
+ *  - blocks 1..n: struct cap_block followed by frame records
+ *  - frame index: one struct cap_index per data block
+ *
+ * A frame record is the time since the previous frame (us) followed by
+ * one value per node, all of them varints. Values are the zig-zag encoded
+ * difference to the same node in the previous frame. The first frame of
+ * every block is stored against zero so that blocks decode on their own.
+ */
+#define CAP_MAGIC		0x3157415258355446ull	/* "FT5XRAW1" */
+#define CAP_BLOCK_MAGIC		0x4b4c4246	/* "FBLK" */
+#define CAP_BLOCK_SIZE		(64 * 1024)
+#define CAP_WINDOW_BLOCKS	16	/* mapped at once */
+#define CAP_ALLOC_BLOCKS	256	/* preallocation step */
+#define CAP_LAT_SAMPLES		65536
+#define CAP_NODES_MAX		(FT_RAW_MAX_TX * FT_RAW_MAX_RX)
+#define CAP_FRAME_MAX		(10 + CAP_NODES_MAX * 3)
+
+struct cap_header {
+	uint64_t magic;
+	uint32_t block_size;
+	uint32_t blocks;		/* data blocks */
+	uint32_t frames;
+	uint8_t tx;
+	uint8_t rx;
+	uint16_t reserved;
+	uint64_t start_ns;		/* CLOCK_MONOTONIC of the first frame */
+	uint64_t index_offset;		/* 0 until the capture is complete */
+};
+
+struct cap_block {
+	uint32_t magic;
+	uint32_t first_frame;
+	uint32_t frames;
+	uint32_t used;			/* bytes, this header included */
+	uint64_t ts_us;			/* first frame, from start_ns */
+};
+
+struct cap_index {
+	uint32_t first_frame;
+	uint32_t block;
+	uint64_t ts_us;
+};
+
+struct cap_writer {
+	int fd;
+	int nodes;
+	struct cap_header hdr;
+	uint8_t *map;			/* CAP_WINDOW_BLOCKS blocks */
+	uint32_t map_block;		/* first block of the window */
+	uint32_t alloc_blocks;		/* file size, in blocks */
+	uint32_t block;
+	struct cap_block *blk;
+	struct cap_index *index;
+	uint32_t index_size;
+	uint64_t prev_us;
+	uint64_t bytes;			/* used in the blocks */
+	uint16_t prev[CAP_NODES_MAX];
+	uint16_t zz[CAP_NODES_MAX];
+};
+
+static volatile sig_atomic_t cap_stop;
+
+static void cap_sigint(int sig)
+{
+	cap_stop = 1;
+}
+
+/* Kept branch free so that the compiler vectorizes it */
+static void cap_delta(const uint16_t *cur, const uint16_t *prev, uint16_t *zz,
+		      int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int16_t d = cur[i] - prev[i];
+
+		zz[i] = (uint16_t)((uint16_t)d << 1) ^ (uint16_t)(d >> 15);
+	}
+}
+
+/* 64-bit, so that time gaps of any length survive */
+static uint8_t *cap_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static const uint8_t *cap_get_varint(const uint8_t *p, const uint8_t *end,
+				     uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+static int cap_alloc(struct cap_writer *w, uint32_t blocks)
+{
+	off_t off = (off_t)w->alloc_blocks * CAP_BLOCK_SIZE;
+	off_t len = (off_t)blocks * CAP_BLOCK_SIZE;
+
+	if (fallocate(w->fd, 0, off, len) < 0) {
+		if (errno != EOPNOTSUPP)
+			return -errno;
+		/* Not all file systems allocate without writing */
+		if (posix_fallocate(w->fd, off, len))
+			return -ENOSPC;
+	}
+	w->alloc_blocks += blocks;
+
+	return 0;
+}
+
+/*
+ * Full windows are handed over to writeback right away and dropped from
+ * the page cache one window later, so memory use and the write rate stay
+ * flat however long the capture is.
+ */
+static int cap_map_window(struct cap_writer *w)
+{
+	size_t len = (size_t)CAP_WINDOW_BLOCKS * CAP_BLOCK_SIZE;
+	off_t off = (off_t)w->map_block * CAP_BLOCK_SIZE;
+	int ret;
+
+	if (w->map) {
+		sync_file_range(w->fd, off, len, SYNC_FILE_RANGE_WRITE);
+		munmap(w->map, len);
+		if (off >= len)
+			posix_fadvise(w->fd, off - len, len,
+				      POSIX_FADV_DONTNEED);
+	}
+
+	w->map_block = w->block;
+	if (w->map_block + CAP_WINDOW_BLOCKS > w->alloc_blocks) {
+		ret = cap_alloc(w, CAP_ALLOC_BLOCKS);
+		if (ret < 0) {
+			ERR("Couldn't preallocate: %s", strerror(-ret));
+			w->map = NULL;
+			return ret;
+		}
+	}
+
+	w->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd,
+		      (off_t)w->map_block * CAP_BLOCK_SIZE);
+	if (w->map == MAP_FAILED) {
+		ERR("Couldn't map: %s", strerror(errno));
+		w->map = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int cap_next_block(struct cap_writer *w)
+{
+	struct cap_index *idx;
+	int ret;
+
+	w->block++;
+	if (!w->map || w->block >= w->map_block + CAP_WINDOW_BLOCKS) {
+		ret = cap_map_window(w);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (w->block > w->index_size) {
+		idx = realloc(w->index, 2 * w->index_size * sizeof(*idx));
+		if (!idx)
+			return -ENOMEM;
+		w->index = idx;
+		w->index_size *= 2;
+	}
+
+	w->blk = (struct cap_block *)(w->map + (size_t)(w->block -
+			w->map_block) * CAP_BLOCK_SIZE);
+	w->blk->magic = CAP_BLOCK_MAGIC;
+	w->blk->first_frame = w->hdr.frames;
+	w->blk->frames = 0;
+	w->blk->used = sizeof(*w->blk);
+	w->bytes += sizeof(*w->blk);
+	memset(w->prev, 0, sizeof(w->prev));
+	w->hdr.blocks = w->block;
+
+	return 0;
+}
+
+static int cap_write_frame(struct cap_writer *w, const uint16_t *frame,
+			   uint64_t ts_ns)
+{
+	uint64_t ts_us = (ts_ns - w->hdr.start_ns) / 1000;
+	uint8_t *p;
+	int i, ret;
+
+	if (!w->blk || w->blk->used + CAP_FRAME_MAX > CAP_BLOCK_SIZE) {
+		ret = cap_next_block(w);
+		if (ret < 0)
+			return ret;
+		w->blk->ts_us = ts_us;
+		w->prev_us = ts_us;
+		w->index[w->block - 1] = (struct cap_index){
+			w->hdr.frames, w->block, ts_us };
+	}
+
+	cap_delta(frame, w->prev, w->zz, w->nodes);
+	p = (uint8_t *)w->blk + w->blk->used;
+	p = cap_put_varint(p, ts_us - w->prev_us);
+	for (i = 0; i < w->nodes; i++)
+		p = cap_put_varint(p, w->zz[i]);
+
+	memcpy(w->prev, frame, w->nodes * sizeof(*frame));
+	w->prev_us = ts_us;
+	w->bytes += p - ((uint8_t *)w->blk + w->blk->used);
+	w->blk->used = p - (uint8_t *)w->blk;
+	w->blk->frames++;
+	w->hdr.frames++;
+
+	return 0;
+}
+
+/* Index goes right after the last block, the preallocated tail is cut */
+static int cap_finish(struct cap_writer *w)
+{
+	size_t index_len = w->hdr.blocks * sizeof(*w->index);
+	int ret = 0;
+
+	if (w->map)
+		munmap(w->map, (size_t)CAP_WINDOW_BLOCKS * CAP_BLOCK_SIZE);
+
+	w->hdr.index_offset = (uint64_t)(w->hdr.blocks + 1) * CAP_BLOCK_SIZE;
+	if (pwrite(w->fd, w->index, index_len, w->hdr.index_offset) !=
+	    index_len ||
+	    ftruncate(w->fd, w->hdr.index_offset + index_len) < 0 ||
+	    pwrite(w->fd, &w->hdr, sizeof(w->hdr), 0) != sizeof(w->hdr))
+		ret = -EIO;
+
+	free(w->index);
+	close(w->fd);
+
+	return ret;
+}
+
+int ft5x06_capture(int fd, int addr, const char *path, int count)
+{
+	struct ft5x06_raw_info raw;
+	struct ft5x06_lat lat_read, lat_write;
+	struct sigaction sa, old_sa;
+	struct cap_writer *w;
+	uint16_t frame[CAP_NODES_MAX];
+	uint64_t t0, t1, ns;
+	uint32_t samples;
+	int i, ret;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->index_size = 64;
+	w->index = calloc(w->index_size, sizeof(*w->index));
+	w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (!w->index || w->fd < 0) {
+		ERR("Unable to open file %s", path);
+		free(w->index);
+		free(w);
+		return -EIO;
+	}
+
+	ret = ft5x06_factory_enter(fd, addr, &raw);
+	if (ret < 0)
+		goto out;
+
+	/* Header first, so that an interrupted capture is recognizable */
+	w->hdr.magic = CAP_MAGIC;
+	w->hdr.block_size = CAP_BLOCK_SIZE;
+	w->hdr.tx = raw.tx;
+	w->hdr.rx = raw.rx;
+	w->nodes = raw.tx * raw.rx;
+	pwrite(w->fd, &w->hdr, sizeof(w->hdr), 0);
+	ret = cap_alloc(w, CAP_ALLOC_BLOCKS);
+	if (ret < 0) {
+		ERR("Couldn't preallocate: %s", strerror(-ret));
+		ft5x06_factory_exit(fd, addr);
+		goto out;
+	}
+
+	samples = (count > 0 && count < CAP_LAT_SAMPLES) ? count :
+						CAP_LAT_SAMPLES;
+	ft5x06_lat_init(&lat_read, samples);
+	ft5x06_lat_init(&lat_write, samples);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cap_sigint;
+	sigaction(SIGINT, &sa, &old_sa);
+	cap_stop = 0;
+
+	if (count > 0)
+		LOG("Capturing %d frames to %s", count, path);
+	else
+		LOG("Capturing to %s, stop with Ctrl-C", path);
+
+	t0 = ft5x06_now_ns();
+	for (i = 0; (count <= 0 || i < count) && !cap_stop; i++) {
+		ret = ft5x06_raw_read(fd, addr, &raw, frame);
+		t1 = ft5x06_now_ns();
+		if (ret < 0)
+			break;
+		ft5x06_lat_add(&lat_read, t1 - t0);
+
+		if (!w->hdr.frames)
+			w->hdr.start_ns = t1;
+		ret = cap_write_frame(w, frame, t1);
+		t0 = ft5x06_now_ns();
+		if (ret < 0)
+			break;
+		ft5x06_lat_add(&lat_write, t0 - t1);
+	}
+
+	sigaction(SIGINT, &old_sa, NULL);
+	ns = ft5x06_now_ns() - w->hdr.start_ns;
+	if (cap_finish(w) < 0 && ret >= 0)
+		ret = -EIO;
+	ft5x06_factory_exit(fd, addr);
+	w->fd = -1;
+
+	LOG("%u frames in %.1f s, %u blocks, %.1f bytes/frame "
+	    "(%.1f%% of raw)", w->hdr.frames, ns / 1e9, w->hdr.blocks,
+	    w->hdr.frames ? (double)w->bytes / w->hdr.frames : 0,
+	    w->hdr.frames ? 100.0 * w->bytes /
+	    ((uint64_t)w->hdr.frames * w->nodes * 2) : 0);
+	ft5x06_lat_report(&lat_read, "raw read");
+	ft5x06_lat_report(&lat_write, "encode + store");
+	ft5x06_lat_free(&lat_read);
+	ft5x06_lat_free(&lat_write);
+out:
+	if (w->fd >= 0) {
+		free(w->index);
+		close(w->fd);
+	}
+	free(w);
+	return ret;
+}
+
+/* Decodes the frames of a block up to the given one (block relative) */
+static int cap_decode(const struct cap_block *blk, int nodes, uint32_t n,
+		      uint16_t *frame, uint64_t *ts_us)
+{
+	const uint8_t *p = (const uint8_t *)(blk + 1);
+	const uint8_t *end = (const uint8_t *)blk + blk->used;
+	uint64_t v;
+	uint32_t i;
+	int j;
+
+	memset(frame, 0, nodes * sizeof(*frame));
+	*ts_us = blk->ts_us;
+	for (i = 0; i <= n; i++) {
+		p = cap_get_varint(p, end, &v);
+		if (!p)
+			return -EINVAL;
+		*ts_us += v;
+		for (j = 0; j < nodes; j++) {
+			p = cap_get_varint(p, end, &v);
+			if (!p)
+				return -EINVAL;
+			frame[j] += (v >> 1) ^ -(v & 1);
+		}
+	}
+
+	return 0;
+}
+
+/* Block of an index entry, NULL unless it lies in the file and is sane */
+static const struct cap_block *cap_block_at(const uint8_t *map, size_t size,
+					    const struct cap_index *entry)
+{
+	const struct cap_block *blk;
+
+	if (!entry->block ||
+	    ((uint64_t)entry->block + 1) * CAP_BLOCK_SIZE > size)
+		return NULL;
+
+	blk = (const struct cap_block *)(map +
+		(size_t)entry->block * CAP_BLOCK_SIZE);
+	if (blk->magic != CAP_BLOCK_MAGIC || !blk->frames ||
+	    blk->used < sizeof(*blk) || blk->used > CAP_BLOCK_SIZE)
+		return NULL;
+
+	return blk;
+}
+
+/*
+ * Summary of a capture file, and when frame is not negative the content
+ * of that frame, found through the index. Nothing read from the file is
+ * trusted, a truncated or corrupted capture is reported as such.
+ */
+int ft5x06_capture_info(const char *path, int frame)
+{
+	const struct cap_header *hdr;
+	const struct cap_index *index;
+	const struct cap_block *blk;
+	uint16_t data[CAP_NODES_MAX];
+	uint64_t ts_us, last_us = 0;
+	struct stat sb;
+	uint8_t *map;
+	int fd, i, j, lo, hi, nodes, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		ERR("Unable to open file %s", path);
+		return -ENOENT;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ERR("Couldn't map: %s", strerror(errno));
+		return -ENOMEM;
+	}
+
+	hdr = (const struct cap_header *)map;
+	if (sb.st_size < sizeof(*hdr) ||
+	    hdr->magic != CAP_MAGIC ||
+	    hdr->block_size != CAP_BLOCK_SIZE ||
+	    hdr->tx * hdr->rx > CAP_NODES_MAX) {
+		ERR("%s is not a capture file", path);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!hdr->index_offset || hdr->index_offset > sb.st_size ||
+	    (uint64_t)hdr->blocks * sizeof(*index) >
+	    sb.st_size - hdr->index_offset) {
+		ERR("%s wasn't completed", path);
+		ret = -EINVAL;
+		goto out;
+	}
+	index = (const struct cap_index *)(map + hdr->index_offset);
+	nodes = hdr->tx * hdr->rx;
+
+	if (hdr->frames && !hdr->blocks) {
+		ERR("Corrupted index, %u frames in no block", hdr->frames);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (hdr->blocks) {
+		blk = cap_block_at(map, sb.st_size, &index[hdr->blocks - 1]);
+		if (!blk ||
+		    cap_decode(blk, nodes, blk->frames - 1, data, &last_us)) {
+			ERR("Corrupted block %u", hdr->blocks);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	LOG("%dx%d nodes, %u frames over %.1f s in %u blocks of %u bytes",
+	    hdr->tx, hdr->rx, hdr->frames, last_us / 1e6, hdr->blocks,
+	    hdr->block_size);
+	if (frame < 0)
+		goto out;
+	if (frame >= hdr->frames) {
+		ERR("Frame %d out of range", frame);
+		ret = -ERANGE;
+		goto out;
+	}
+
+	/* Last block starting at or before the frame */
+	lo = 0;
+	hi = hdr->blocks - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+
+		if (index[mid].first_frame <= frame)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	blk = cap_block_at(map, sb.st_size, &index[lo]);
+	if (!blk || frame < blk->first_frame ||
+	    frame - blk->first_frame >= blk->frames ||
+	    cap_decode(blk, nodes, frame - blk->first_frame, data, &ts_us)) {
+		ERR("Corrupted block %u", index[lo].block);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	printf("frame %d at %.6f s\n", frame, ts_us / 1e6);
+	for (i = 0; i < hdr->tx; i++) {
+		for (j = 0; j < hdr->rx; j++)
+			printf("%6u", data[i * hdr->rx + j]);
+		printf("\n");
+	}
+out:
+	munmap(map, sb.st_size);
+	return ret;
+}
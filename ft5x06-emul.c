@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Emulated FT5x06 controller, plugged in as the bus transport
+ */
+
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+#define EMUL_BUS_HZ		400000
+#define EMUL_ERASE_PCT		60	/* erase time vs. delay_erase_flash */
+#define EMUL_PROGRAM_US		1000	/* flash status update after a packet */
+#define EMUL_TX			12
+#define EMUL_RX			20
+#define EMUL_FW_VERSION		0x10
+#define EMUL_TAP_MS		200	/* synthetic tap duration */
+#define EMUL_TAP_GAP_MS		700	/* minimum time between taps */
+#define EMUL_TAP_JITTER_MS	600
+
+enum emul_mode {
+	EMUL_APP,
+	EMUL_ROMBOOT,		/* reset through 0xfc, waiting for 55/aa */
+	EMUL_UPGRADE,
+};
+
+struct emul {
+	const struct ft5x06_fw_update_info *info;
+	struct ft5x06_fw_update_info family;	/* flash size overridden */
+	enum emul_mode mode;
+	bool rst_armed;
+	bool hid_armed;
+	uint8_t regs[256];
+	uint8_t cmd[FT_FW_PKT_META_LEN];	/* last write, for reads */
+	uint16_t status;
+	uint64_t status_ns;			/* status valid from then */
+	uint8_t ecc;
+	uint32_t fw_len;
+	uint32_t flash_size;
+	uint8_t *flash;
+	uint32_t seed;
+	bool taps;
+	uint64_t down_ns;			/* current or last tap */
+	uint64_t next_down_ns;
+};
+
+static struct emul emul;
+
+/* Several threads may share the emulator, as they would share a bus */
+static pthread_mutex_t emul_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t emul_rand(void)
+{
+	emul.seed ^= emul.seed << 13;
+	emul.seed ^= emul.seed >> 17;
+	emul.seed ^= emul.seed << 5;
+	return emul.seed;
+}
+
+/* Keeps the caller busy for as long as the bytes would take on the wire */
+static void emul_wire(int bytes)
+{
+	uint64_t end = ft5x06_now_ns() +
+		       (uint64_t)bytes * 9 * 1000000000ull / EMUL_BUS_HZ;
+	struct timespec ts;
+
+	if (bytes > 64) {
+		uint64_t left = end - ft5x06_now_ns();
+
+		ts.tv_sec = left / 1000000000ull;
+		ts.tv_nsec = left % 1000000000ull;
+		nanosleep(&ts, NULL);
+	}
+	while (ft5x06_now_ns() < end)
+		;
+}
+
+/* Flat 5000 counts panel with a few counts of noise, big endian */
+static uint8_t emul_raw(int i)
+{
+	static uint16_t raw;
+
+	if (i % 2)
+		return raw;
+
+	raw = 5000 + (i / 2) * 3 + emul_rand() % 5;
+	return raw >> 8;
+}
+
+static void emul_set_status(uint16_t status, uint64_t delay_us)
+{
+	emul.status = status;
+	emul.status_ns = ft5x06_now_ns() + delay_us * 1000;
+}
+
+static void emul_write_app(const uint8_t *buf, uint16_t len)
+{
+	uint8_t reg = buf[0];
+	int i;
+
+	if (reg == FT_RST_CMD_REG1 && len == 2) {
+		if (buf[1] == FT_UPGRADE_AA)
+			emul.rst_armed = true;
+		else if (buf[1] == FT_UPGRADE_55 && emul.rst_armed)
+			emul.mode = EMUL_ROMBOOT;
+		return;
+	}
+
+	for (i = 1; i < len; i++)
+		emul.regs[(uint8_t)(reg + i - 1)] = buf[i];
+
+	/* Scans complete instantly: clear the start bit right away */
+	if (reg == ID_G_DEVICE_MODE && len > 1)
+		emul.regs[ID_G_DEVICE_MODE] &= ~FT_MODE_START_SCAN;
+}
+
+/* One finger sliding right for EMUL_TAP_MS, at random intervals */
+static void emul_touch(void)
+{
+	uint64_t now = ft5x06_now_ns();
+	uint8_t *p = &emul.regs[ID_G_TOUCH1_XH];
+	uint16_t x, y = 200;
+
+	if (now >= emul.next_down_ns) {
+		emul.down_ns = emul.next_down_ns;
+		emul.next_down_ns = emul.down_ns + (EMUL_TAP_MS +
+				    EMUL_TAP_GAP_MS +
+				    emul_rand() % EMUL_TAP_JITTER_MS) *
+				    1000000ull;
+	}
+
+	if (!emul.down_ns || now >= emul.down_ns + EMUL_TAP_MS * 1000000ull) {
+		emul.regs[ID_G_TD_STATUS] = 0;
+		return;
+	}
+
+	x = 100 + (now - emul.down_ns) / 1000000;
+	emul.regs[ID_G_TD_STATUS] = 1;
+	p[0] = (FT_TOUCH_EVENT_CONTACT << 6) | (x >> 8);
+	p[1] = x;
+	p[2] = y >> 8;
+	p[3] = y;
+	p[4] = 0x40;
+	p[5] = 0x10;
+}
+
+static void emul_read_app(uint8_t *buf, uint16_t len)
+{
+	uint8_t reg = emul.cmd[0];
+	bool factory = (emul.regs[ID_G_DEVICE_MODE] & 0x70) == FT_MODE_FACTORY;
+	int i;
+
+	if (emul.taps && !factory && reg <= ID_G_TD_STATUS &&
+	    reg + len > ID_G_TD_STATUS)
+		emul_touch();
+
+	for (i = 0; i < len; i++) {
+		uint8_t r = reg + i;
+
+		if (factory && r == FT_FACTORY_TX_NUM)
+			buf[i] = EMUL_TX;
+		else if (factory && r == FT_FACTORY_RX_NUM)
+			buf[i] = EMUL_RX;
+		else if (factory && reg == FT_FACTORY_RAW_DATA)
+			buf[i] = emul_raw(i);
+		else
+			buf[i] = emul.regs[r];
+	}
+}
+
+static void emul_write_upgrade(const uint8_t *buf, uint16_t len)
+{
+	uint32_t offset, length, i;
+
+	switch (buf[0]) {
+	case FT_ERASE_APP_REG:
+		memset(emul.flash, 0xff, emul.flash_size);
+		emul.ecc = 0;
+		emul_set_status(FT_FLASH_ERASE_DONE,
+				emul.info->delay_erase_flash * 10ull *
+				EMUL_ERASE_PCT);
+		break;
+	case 0xb0:
+		if (len >= 4)
+			emul.fw_len = (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		break;
+	case FT_FW_START_REG:
+		if (len < FT_FW_PKT_META_LEN)
+			break;
+		offset = (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		length = (buf[4] << 8) | buf[5];
+		if (length > len - FT_FW_PKT_META_LEN)
+			length = len - FT_FW_PKT_META_LEN;
+		for (i = 0; i < length && offset + i < emul.flash_size; i++) {
+			emul.flash[offset + i] = buf[FT_FW_PKT_META_LEN + i];
+			emul.ecc ^= buf[FT_FW_PKT_META_LEN + i];
+		}
+		emul_set_status(0x1000 + offset / FT_FW_PKT_LEN,
+				EMUL_PROGRAM_US);
+		break;
+	case FT_REG_RESET_FW:
+		emul.mode = EMUL_APP;
+		emul.rst_armed = false;
+		break;
+	}
+}
+
+static void emul_read_upgrade(uint8_t *buf, uint16_t len)
+{
+	uint32_t offset, i;
+
+	memset(buf, 0, len);
+	switch (emul.cmd[0]) {
+	case FT_READ_ID_REG:
+		buf[0] = emul.info->upgrade_id_1;
+		if (len > 1)
+			buf[1] = emul.info->upgrade_id_2;
+		break;
+	case FT_FLASH_STATUS:
+		if (ft5x06_now_ns() >= emul.status_ns && len >= 2) {
+			buf[0] = emul.status >> 8;
+			buf[1] = emul.status;
+		}
+		break;
+	case FT_REG_ECC:
+		buf[0] = emul.ecc;
+		break;
+	case FT_FW_READ_REG:
+		offset = (emul.cmd[1] << 16) | (emul.cmd[2] << 8) |
+			 emul.cmd[3];
+		for (i = 0; i < len && offset + i < emul.flash_size; i++)
+			buf[i] = emul.flash[offset + i];
+		break;
+	}
+}
+
+/* Flash is allocated on first entry, sized with the --flash-size override */
+static void emul_enter_upgrade(void)
+{
+	emul.mode = EMUL_UPGRADE;
+	if (emul.flash)
+		return;
+
+	emul.flash_size = emul.info->fw_max_size;
+	emul.flash = malloc(emul.flash_size);
+	if (!emul.flash) {
+		emul.flash_size = 0;
+		return;
+	}
+	memset(emul.flash, 0xff, emul.flash_size);
+}
+
+static void emul_read_hid(uint8_t *buf, uint16_t len)
+{
+	static const uint8_t ack[] = { 0xeb, 0xaa, 0x08 };
+
+	memcpy(buf, ack, len < sizeof(ack) ? len : sizeof(ack));
+	emul.hid_armed = false;
+}
+
+static int emul_xfer(void *priv, int fd, struct i2c_rdwr_ioctl_data *data)
+{
+	int i, bytes = 0;
+
+	pthread_mutex_lock(&emul_lock);
+	for (i = 0; i < data->nmsgs; i++) {
+		struct i2c_msg *msg = &data->msgs[i];
+
+		/* Address byte, payload, ACK bits are in emul_wire() */
+		bytes += 1 + msg->len;
+		if (msg->flags & I2C_M_RD) {
+			if (emul.hid_armed)
+				emul_read_hid(msg->buf, msg->len);
+			else if (emul.mode == EMUL_APP)
+				emul_read_app(msg->buf, msg->len);
+			else
+				emul_read_upgrade(msg->buf, msg->len);
+			continue;
+		}
+
+		if (msg->len == 0)
+			continue;
+		memset(emul.cmd, 0, sizeof(emul.cmd));
+		memcpy(emul.cmd, msg->buf, msg->len < sizeof(emul.cmd) ?
+		       msg->len : sizeof(emul.cmd));
+
+		/* HID to I2C switch, answered by the next read */
+		if (msg->len == 3 && msg->buf[0] == 0xeb &&
+		    msg->buf[1] == 0xaa && msg->buf[2] == 0x09)
+			emul.hid_armed = true;
+		else if (msg->len == 2 && msg->buf[0] == FT_UPGRADE_55 &&
+			 msg->buf[1] == FT_UPGRADE_AA && emul.mode != EMUL_APP)
+			emul_enter_upgrade();
+		else if (emul.mode == EMUL_UPGRADE)
+			emul_write_upgrade(msg->buf, msg->len);
+		else if (emul.mode == EMUL_APP)
+			emul_write_app(msg->buf, msg->len);
+	}
+	emul_wire(bytes);
+	pthread_mutex_unlock(&emul_lock);
+
+	return data->nmsgs;
+}
+
+static const struct ft5x06_transport emul_transport = {
+	.name = "emulator",
+	.xfer = emul_xfer,
+	.priv = &emul,
+};
+
+int ft5x06_emul_init(int chip_id)
+{
+	if (ft5x06_get_flash_info(chip_id, &emul.family) < 0) {
+		ERR("Can't emulate unknown chip ID %x", chip_id);
+		return -ENODEV;
+	}
+	emul.info = &emul.family;
+
+	emul.mode = EMUL_APP;
+	emul.seed = 0x5eed1234;
+	emul.regs[ID_G_CIPHER] = chip_id;
+	emul.regs[ID_G_FIRMID] = EMUL_FW_VERSION;
+	emul.regs[ID_G_THGROUP] = 20;
+	emul.regs[ID_G_THPEAK] = 60;
+	emul.regs[ID_G_THCAL] = 16;
+	emul.regs[ID_G_THWATER] = 60;
+	emul.regs[ID_G_PERIODACTIVE] = 10;
+
+	ft5x06_set_transport(&emul_transport);
+	LOG("Emulating %s", emul.info->fts_name);
+
+	return 0;
+}
+
+/* Flash content as programmed, for the harnesses to check the result */
+const uint8_t *ft5x06_emul_flash(uint32_t *len)
+{
+	*len = emul.fw_len;
+	return emul.flash;
+}
+
+/* Synthetic taps, off by default so that the panel looks idle */
+void ft5x06_emul_taps(bool enable)
+{
+	emul.taps = enable;
+	emul.down_ns = 0;
+	emul.next_down_ns = ft5x06_now_ns() + EMUL_TAP_GAP_MS * 1000000ull;
+}
+
+/* Start of the current or last synthetic tap, 0 when there is none */
+uint64_t ft5x06_emul_touch_down_ns(void)
+{
+	return emul.taps ? emul.down_ns : 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Fault injection at the transport boundary and flash retry harness
+ */
+
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+#define FAULT_MAX_ATTEMPTS	5
+#define FAULT_DEFAULT_RATE	0.01
+#define FAULT_BENCH_SIZE	(16 * 1024)
+#define FAULT_SCRATCH_LEN	(FT_FW_PKT_LEN + FT_FW_PKT_META_LEN)
+
+static const char * const fault_names[FT_FAULT_TYPES] = {
+	[FT_FAULT_NAK] = "nak",
+	[FT_FAULT_SHORT] = "short",
+	[FT_FAULT_DELAY] = "delay",
+	[FT_FAULT_CORRUPT] = "corrupt",
+};
+
+struct fault_ctx {
+	const struct ft5x06_transport *lower;
+	double rate[FT_FAULT_TYPES];
+	uint32_t seed;
+	uint32_t xfers;
+	uint32_t injected[FT_FAULT_TYPES];
+	uint8_t scratch[FAULT_SCRATCH_LEN];
+};
+
+static struct fault_ctx fault;
+
+static bool fault_roll(int type)
+{
+	fault.seed ^= fault.seed << 13;
+	fault.seed ^= fault.seed >> 17;
+	fault.seed ^= fault.seed << 5;
+
+	return fault.rate[type] > 0 &&
+	       fault.seed / 4294967296.0 < fault.rate[type];
+}
+
+static struct i2c_msg *fault_find_read(struct i2c_rdwr_ioctl_data *data)
+{
+	int i;
+
+	for (i = 0; i < data->nmsgs; i++)
+		if (data->msgs[i].flags & I2C_M_RD)
+			return &data->msgs[i];
+
+	return NULL;
+}
+
+static int fault_xfer(void *priv, int fd, struct i2c_rdwr_ioctl_data *data)
+{
+	struct i2c_msg *rd = fault_find_read(data);
+	struct i2c_msg *wr = (data->msgs[0].flags & I2C_M_RD) ?
+			     NULL : &data->msgs[0];
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data copy;
+	uint8_t *buf = NULL;
+	int ret;
+
+	fault.xfers++;
+
+	/* Address NAK: nothing reaches the device */
+	if (fault_roll(FT_FAULT_NAK)) {
+		fault.injected[FT_FAULT_NAK]++;
+		errno = ENXIO;
+		return -1;
+	}
+
+	/* Corrupted write: flip one bit of a copy of the payload */
+	if (wr && !rd && wr->len <= FAULT_SCRATCH_LEN && data->nmsgs == 1 &&
+	    fault_roll(FT_FAULT_CORRUPT)) {
+		fault.injected[FT_FAULT_CORRUPT]++;
+		memcpy(fault.scratch, wr->buf, wr->len);
+		fault.scratch[fault.seed % wr->len] ^= 1 << (fault.seed % 8);
+		msgs[0] = *wr;
+		msgs[0].buf = fault.scratch;
+		copy.msgs = msgs;
+		copy.nmsgs = 1;
+		return ft5x06_transport_xfer(fault.lower, fd, &copy);
+	}
+
+	ret = ft5x06_transport_xfer(fault.lower, fd, data);
+	if (ret < 0 || !rd || rd->len == 0)
+		return ret;
+	buf = rd->buf;
+
+	if (wr && wr->buf[0] == FT_FLASH_STATUS &&
+	    fault_roll(FT_FAULT_DELAY)) {
+		/* Status not updated yet */
+		fault.injected[FT_FAULT_DELAY]++;
+		memset(buf, 0, rd->len);
+	} else if (fault_roll(FT_FAULT_SHORT)) {
+		/* Device stopped driving SDA: the tail reads as 0xff */
+		int keep = fault.seed % rd->len;
+
+		fault.injected[FT_FAULT_SHORT]++;
+		memset(buf + keep, 0xff, rd->len - keep);
+	} else if (fault_roll(FT_FAULT_CORRUPT)) {
+		fault.injected[FT_FAULT_CORRUPT]++;
+		buf[fault.seed % rd->len] ^= 1 << (fault.seed % 8);
+	}
+
+	return ret;
+}
+
+static const struct ft5x06_transport fault_transport = {
+	.name = "fault",
+	.xfer = fault_xfer,
+	.priv = &fault,
+};
+
+/* Parses "nak=0.01,short=0.005,..." into per type injection rates */
+int ft5x06_fault_parse(const char *spec, double *rates)
+{
+	char *dup = strdup(spec), *tok, *save = NULL;
+	int i, ret = 0;
+
+	if (!dup)
+		return -ENOMEM;
+
+	for (tok = strtok_r(dup, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '=');
+
+		for (i = 0; i < FT_FAULT_TYPES; i++)
+			if (eq && strncmp(tok, fault_names[i], eq - tok) == 0 &&
+			    strlen(fault_names[i]) == eq - tok)
+				break;
+		if (i >= FT_FAULT_TYPES) {
+			ERR("Unknown fault %s", tok);
+			ret = -EINVAL;
+			break;
+		}
+		rates[i] = strtod(eq + 1, NULL);
+	}
+
+	free(dup);
+	return ret;
+}
+
+/* Stacks the fault layer on top of the current transport */
+int ft5x06_fault_init(const double *rates)
+{
+	if (ft5x06_get_transport() != &fault_transport)
+		fault.lower = ft5x06_get_transport();
+	memcpy(fault.rate, rates, sizeof(fault.rate));
+	fault.seed = 0xfa017;
+	fault.xfers = 0;
+	memset(fault.injected, 0, sizeof(fault.injected));
+	ft5x06_set_transport(&fault_transport);
+
+	return 0;
+}
+
+struct fault_run {
+	int attempts;
+	bool ok;
+	bool intact;
+	uint64_t ns;
+	uint32_t xfers;
+	uint32_t injected;
+};
+
+/*
+ * Flashes the image the way an update agent would: the whole upgrade is
+ * restarted until it reports success or FAULT_MAX_ATTEMPTS is reached.
+ */
+static void fault_run_flash(int fd, int addr, int chip_id,
+			    const uint8_t *img, uint32_t len,
+			    const double *rates, int type,
+			    struct fault_run *run)
+{
+	const uint8_t *flash;
+	uint32_t flash_len;
+	uint64_t start;
+	int i;
+
+	ft5x06_fault_init(rates);
+	memset(run, 0, sizeof(*run));
+
+	start = ft5x06_now_ns();
+	for (run->attempts = 1; run->attempts <= FAULT_MAX_ATTEMPTS;
+	     run->attempts++) {
+		if (ft5x06_fw_upgrade(fd, addr, chip_id, img, len) == 0) {
+			run->ok = true;
+			break;
+		}
+	}
+	run->ns = ft5x06_now_ns() - start;
+	run->xfers = fault.xfers;
+	for (i = 0; i < FT_FAULT_TYPES; i++)
+		if (type < 0 || i == type)
+			run->injected += fault.injected[i];
+
+	flash = ft5x06_emul_flash(&flash_len);
+	run->intact = flash_len == len && memcmp(flash, img, len) == 0;
+}
+
+int ft5x06_fault_bench(int fd, int addr, int chip_id, const uint8_t *img,
+		       uint32_t len, const double *rates)
+{
+	struct fault_run base, runs[FT_FAULT_TYPES];
+	double none[FT_FAULT_TYPES] = { 0 };
+	uint8_t *synth = NULL;
+	int i;
+
+	if (!img) {
+		synth = malloc(FAULT_BENCH_SIZE);
+		if (!synth)
+			return -ENOMEM;
+		fault.seed = 0x1a6e;
+		for (i = 0; i < FAULT_BENCH_SIZE; i++) {
+			fault_roll(FT_FAULT_NAK);
+			synth[i] = fault.seed;
+		}
+		img = synth;
+		len = FAULT_BENCH_SIZE;
+	}
+
+	LOG("Baseline run, %u bytes", len);
+	fault_run_flash(fd, addr, chip_id, img, len, none, -1, &base);
+
+	for (i = 0; i < FT_FAULT_TYPES; i++) {
+		double only[FT_FAULT_TYPES] = { 0 };
+
+		only[i] = rates[i] > 0 ? rates[i] : FAULT_DEFAULT_RATE;
+		LOG("Injecting %s at %.3f", fault_names[i], only[i]);
+		fault_run_flash(fd, addr, chip_id, img, len, only, i, &runs[i]);
+	}
+
+	LOG("baseline: %s in %.0f ms, %u transactions", base.ok ? "ok" : "FAIL",
+	    base.ns / 1e6, base.xfers);
+	for (i = 0; i < FT_FAULT_TYPES; i++) {
+		struct fault_run *r = &runs[i];
+		double extra_ms = ((double)r->ns - base.ns) / 1e6;
+		int extra_xfers = (int)r->xfers - (int)base.xfers;
+
+		LOG("%-8s %s after %d attempt(s)%s, %u injected, %+.0f ms, "
+		    "%+d transactions (%.1f ms, %.1f transactions per fault)",
+		    fault_names[i], r->ok ? "ok" : "FAIL",
+		    r->ok ? r->attempts : FAULT_MAX_ATTEMPTS,
+		    (r->ok && !r->intact) ? " but flash CORRUPTED" : "",
+		    r->injected, extra_ms, extra_xfers,
+		    r->injected ? extra_ms / r->injected : 0,
+		    r->injected ? (double)extra_xfers / r->injected : 0);
+	}
+
+	ft5x06_set_transport(fault.lower);
+	free(synth);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Ordered flash operations run within a single bootloader session
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ft5x06.h"
+
+static const char * const job_names[] = {
+	[FT_JOB_DUMP] = "dump",
+	[FT_JOB_ERASE] = "erase",
+	[FT_JOB_PROGRAM] = "program",
+	[FT_JOB_VERIFY] = "verify",
+	[FT_JOB_PARAM] = "param",
+};
+
+/*
+ * Parses "dump=backup.bin,erase,program=fw.bin,verify,param=0x7c00:p.bin"
+ * The spec string is kept referenced by the jobs, and modified.
+ */
+int ft5x06_job_parse(char *spec, struct ft5x06_job *jobs, int max)
+{
+	char *tok, *save = NULL;
+	int i, n = 0;
+
+	for (tok = strtok_r(spec, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *arg = strchr(tok, '=');
+		struct ft5x06_job *job = &jobs[n];
+
+		if (n >= max) {
+			ERR("Too many operations (max %d)", max);
+			return -E2BIG;
+		}
+		if (arg)
+			*arg++ = '\0';
+
+		for (i = 0; i < ARRAY_SIZE(job_names); i++)
+			if (strcmp(tok, job_names[i]) == 0)
+				break;
+		if (i >= ARRAY_SIZE(job_names)) {
+			ERR("Unknown operation %s", tok);
+			return -EINVAL;
+		}
+
+		memset(job, 0, sizeof(*job));
+		job->type = i;
+		job->path = arg;
+		if (job->type == FT_JOB_PARAM && arg) {
+			job->offset = strtoul(arg, &arg, 16);
+			job->path = (*arg == ':') ? arg + 1 : NULL;
+		}
+
+		if (!job->path &&
+		    (job->type == FT_JOB_DUMP || job->type == FT_JOB_PROGRAM ||
+		     job->type == FT_JOB_PARAM)) {
+			ERR("%s needs a file", tok);
+			return -EINVAL;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+static int job_run_one(struct ft5x06_session *s, struct ft5x06_job *job)
+{
+	struct stat sb;
+	int fd, ret;
+
+	switch (job->type) {
+	case FT_JOB_ERASE:
+		return ft5x06_session_erase(s);
+	case FT_JOB_VERIFY:
+		return ft5x06_session_verify(s);
+	case FT_JOB_DUMP:
+		fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			ERR("Unable to open file %s", job->path);
+			return -errno;
+		}
+		ret = ft5x06_session_dump(s, fd, 0);
+		close(fd);
+		return ret;
+	default:
+		break;
+	}
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		ERR("Unable to open file %s", job->path);
+		if (fd >= 0)
+			close(fd);
+		return -ENOENT;
+	}
+	LOG("Using %s (%ld bytes)", job->path, sb.st_size);
+
+	if (job->type == FT_JOB_PROGRAM)
+		ret = ft5x06_session_program_fd(s, fd, sb.st_size);
+	else
+		ret = ft5x06_session_param_fd(s, job->offset, fd, sb.st_size);
+	close(fd);
+
+	return ret;
+}
+
+/* Stops at the first failing operation, the firmware is reset anyway */
+int ft5x06_job_run(int fd, int addr, int chip_id, struct ft5x06_job *jobs,
+		   int count)
+{
+	struct ft5x06_session s;
+	uint64_t start, begin, end;
+	int i, ret;
+
+	start = ft5x06_now_ns();
+	ret = ft5x06_session_begin(&s, fd, addr, chip_id);
+	begin = ft5x06_now_ns();
+	if (ret < 0) {
+		ERR("Couldn't enter upgrade mode (%d)", ret);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t t = ft5x06_now_ns();
+
+		jobs[i].ret = job_run_one(&s, &jobs[i]);
+		jobs[i].ns = ft5x06_now_ns() - t;
+		ft5x06_trace_span(job_names[jobs[i].type], t, NULL);
+		if (jobs[i].ret < 0) {
+			ERR("%s failed (%d)", job_names[jobs[i].type],
+			    jobs[i].ret);
+			ret = jobs[i].ret;
+			break;
+		}
+	}
+
+	ft5x06_session_end(&s);
+	end = ft5x06_now_ns();
+
+	LOG("%-8s %8.1f ms", "enter", (begin - start) / 1e6);
+	for (i = 0; i < count; i++)
+		LOG("%-8s %8.1f ms%s", job_names[jobs[i].type], jobs[i].ns / 1e6,
+		    jobs[i].ret < 0 ? " (failed)" :
+		    (ret < 0 && !jobs[i].ns) ? " (skipped)" : "");
+	LOG("%-8s %8.1f ms", "total", (end - start) / 1e6);
+
+	return ret;
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Kernel i2c tracepoints (tracefs) joined with the tool transactions, to
+ * tell system call, adapter driver and wire time apart
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ft5x06.h"
+
+#define KT_MAX_XFERS		65536
+#define KT_MAX_EVENTS		(KT_MAX_XFERS * 4)
+#define KT_BUFFER_KB		"8192"
+#define KT_DEFAULT_HZ		100000
+#define KT_SLACK_NS		1000	/* tracefs prints microseconds */
+
+static const char * const kt_roots[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+static const char * const kt_events[] = {
+	"i2c_write", "i2c_read", "i2c_result",
+};
+
+/* As seen from user space */
+struct kt_xfer {
+	uint64_t enter_ns;
+	uint64_t exit_ns;
+	uint32_t bits;			/* on the wire, ACKs included */
+};
+
+struct kt_event {
+	uint64_t ns;
+	bool result;			/* i2c_result, otherwise message */
+};
+
+static struct {
+	const struct ft5x06_transport *lower;
+	char dir[96];			/* our tracefs instance */
+	int bus;
+	uint32_t bus_hz;
+	struct kt_xfer *xfers;
+	uint32_t count;
+} kt;
+
+static int kt_xfer(void *priv, int fd, struct i2c_rdwr_ioctl_data *data)
+{
+	struct kt_xfer *x = NULL;
+	int i, ret;
+
+	if (kt.count < KT_MAX_XFERS) {
+		x = &kt.xfers[kt.count++];
+		/* Start, address and data bytes with ACK, stop */
+		x->bits = 1;
+		for (i = 0; i < data->nmsgs; i++)
+			x->bits += 1 + (1 + data->msgs[i].len) * 9;
+		x->enter_ns = ft5x06_now_ns();
+	}
+
+	ret = ft5x06_transport_xfer(kt.lower, fd, data);
+
+	if (x)
+		x->exit_ns = ft5x06_now_ns();
+	return ret;
+}
+
+static const struct ft5x06_transport kt_transport = {
+	.name = "ktrace",
+	.xfer = kt_xfer,
+	.priv = &kt,
+};
+
+static int kt_write(const char *file, const char *val)
+{
+	char path[160];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", kt.dir, file);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != strlen(val)) {
+		ERR("Couldn't write %s: %s", path, strerror(errno));
+		ret = -errno;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/* Bus clock from the device tree, the transfers are paced on it */
+static uint32_t kt_bus_hz(int bus)
+{
+	char path[96];
+	uint8_t be[4];
+	uint32_t hz;
+	int fd;
+
+	snprintf(path, sizeof(path),
+		 "/sys/class/i2c-adapter/i2c-%d/of_node/clock-frequency", bus);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return KT_DEFAULT_HZ;
+	if (read(fd, be, sizeof(be)) != sizeof(be)) {
+		close(fd);
+		return KT_DEFAULT_HZ;
+	}
+	close(fd);
+
+	/* The property is big endian, 0 would be a divisor later on */
+	hz = (uint32_t)be[0] << 24 | be[1] << 16 | be[2] << 8 | be[3];
+	return hz ? hz : KT_DEFAULT_HZ;
+}
+
+/*
+ * Creates a dedicated tracefs instance, so the global buffer and other
+ * users are left alone, with the mono clock so that event timestamps
+ * compare with CLOCK_MONOTONIC.
+ */
+int ft5x06_ktrace_start(int bus)
+{
+	struct stat st;
+	char filter[64], file[64];
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(kt_roots); i++) {
+		snprintf(kt.dir, sizeof(kt.dir), "%s/instances", kt_roots[i]);
+		if (stat(kt.dir, &st) == 0)
+			break;
+	}
+	if (i >= ARRAY_SIZE(kt_roots)) {
+		ERR("tracefs isn't mounted");
+		return -ENOENT;
+	}
+
+	snprintf(kt.dir, sizeof(kt.dir), "%s/instances/ft5x06-%d",
+		 kt_roots[i], getpid());
+	if (mkdir(kt.dir, 0755) < 0) {
+		ERR("Couldn't create %s: %s", kt.dir, strerror(errno));
+		return -errno;
+	}
+
+	kt.xfers = calloc(KT_MAX_XFERS, sizeof(*kt.xfers));
+	if (!kt.xfers) {
+		rmdir(kt.dir);
+		return -ENOMEM;
+	}
+
+	ret = kt_write("trace_clock", "mono");
+	if (ret == 0)
+		ret = kt_write("buffer_size_kb", KT_BUFFER_KB);
+	snprintf(filter, sizeof(filter), "adapter_nr == %d && common_pid == %d",
+		 bus, getpid());
+	for (i = 0; i < ARRAY_SIZE(kt_events) && ret == 0; i++) {
+		snprintf(file, sizeof(file), "events/i2c/%s/filter",
+			 kt_events[i]);
+		ret = kt_write(file, filter);
+		snprintf(file, sizeof(file), "events/i2c/%s/enable",
+			 kt_events[i]);
+		if (ret == 0)
+			ret = kt_write(file, "1");
+	}
+	if (ret == 0)
+		ret = kt_write("tracing_on", "1");
+	if (ret < 0) {
+		rmdir(kt.dir);
+		free(kt.xfers);
+		kt.xfers = NULL;
+		return ret;
+	}
+
+	kt.bus = bus;
+	kt.bus_hz = kt_bus_hz(bus);
+	kt.count = 0;
+	kt.lower = ft5x06_get_transport();
+	ft5x06_set_transport(&kt_transport);
+	LOG("Tracing i2c-%d through %s, bus at %u Hz", bus, kt.dir, kt.bus_hz);
+
+	return 0;
+}
+
+/*
+ * Keeps message and result events, from lines such as:
+ *   ft5x06-tool-812 [001] ..... 1234.567890: i2c_write: i2c-2 #0 ...
+ */
+static uint32_t kt_parse(FILE *f, struct kt_event *events, uint32_t max)
+{
+	char line[512];
+	uint32_t n = 0;
+
+	while (n < max && fgets(line, sizeof(line), f)) {
+		char *p = strstr(line, ": i2c_"), *ts;
+
+		if (line[0] == '#' || !p)
+			continue;
+
+		for (ts = p; ts > line && ts[-1] != ' '; ts--)
+			;
+		events[n].ns = strtod(ts, NULL) * 1e9 + 0.5;
+		if (strncmp(p + 2, "i2c_result", 10) == 0)
+			events[n++].result = true;
+		else if (strncmp(p + 2, "i2c_write", 9) == 0 ||
+			 strncmp(p + 2, "i2c_read", 8) == 0)
+			events[n++].result = false;
+	}
+
+	return n;
+}
+
+/*
+ * The kernel part of a transaction goes from its first message event,
+ * just before the adapter transfer, to its result event. Whatever is
+ * around it is system call overhead, and what exceeds the bit time is
+ * spent in the adapter driver (runtime PM, DMA setup, clock stretching).
+ */
+static void kt_join(struct kt_event *events, uint32_t nevents)
+{
+	struct ft5x06_lat lat_total, lat_sys, lat_drv, lat_wire;
+	uint32_t i, j = 0, matched = 0;
+
+	ft5x06_lat_init(&lat_total, kt.count);
+	ft5x06_lat_init(&lat_sys, kt.count);
+	ft5x06_lat_init(&lat_drv, kt.count);
+	ft5x06_lat_init(&lat_wire, kt.count);
+
+	for (i = 0; i < kt.count; i++) {
+		struct kt_xfer *x = &kt.xfers[i];
+		uint64_t start = 0, end = 0, wire, kernel;
+		int64_t sys;
+
+		while (j < nevents && events[j].ns + KT_SLACK_NS < x->enter_ns)
+			j++;
+		for (; j < nevents && events[j].ns <= x->exit_ns + KT_SLACK_NS;
+		     j++) {
+			if (!events[j].result && !start) {
+				start = events[j].ns;
+			} else if (events[j].result && start) {
+				end = events[j].ns;
+				j++;
+				break;
+			}
+		}
+		if (!start || !end)
+			continue;
+
+		matched++;
+		kernel = end - start;
+		wire = (uint64_t)x->bits * 1000000000ull / kt.bus_hz;
+		sys = (int64_t)(x->exit_ns - x->enter_ns) - kernel;
+		ft5x06_lat_add(&lat_total, x->exit_ns - x->enter_ns);
+		ft5x06_lat_add(&lat_sys, sys > 0 ? sys : 0);
+		ft5x06_lat_add(&lat_drv, kernel > wire ? kernel - wire : 0);
+		ft5x06_lat_add(&lat_wire, wire);
+	}
+
+	LOG("%u transactions, %u kernel events, %u matched", kt.count,
+	    nevents, matched);
+	ft5x06_lat_report(&lat_total, "transaction");
+	ft5x06_lat_report(&lat_sys, "system call");
+	ft5x06_lat_report(&lat_drv, "adapter driver");
+	ft5x06_lat_report(&lat_wire, "wire (computed)");
+
+	ft5x06_lat_free(&lat_total);
+	ft5x06_lat_free(&lat_sys);
+	ft5x06_lat_free(&lat_drv);
+	ft5x06_lat_free(&lat_wire);
+}
+
+void ft5x06_ktrace_report(void)
+{
+	struct kt_event *events;
+	char path[128];
+	uint32_t n = 0;
+	FILE *f;
+
+	if (!kt.xfers)
+		return;
+
+	kt_write("tracing_on", "0");
+	if (ft5x06_get_transport() == &kt_transport)
+		ft5x06_set_transport(kt.lower);
+
+	events = malloc(KT_MAX_EVENTS * sizeof(*events));
+	snprintf(path, sizeof(path), "%s/trace", kt.dir);
+	f = fopen(path, "r");
+	if (events && f)
+		n = kt_parse(f, events, KT_MAX_EVENTS);
+	else
+		ERR("Couldn't read %s", path);
+	if (f)
+		fclose(f);
+
+	if (events)
+		kt_join(events, n);
+
+	/* Removing the instance disables its events and frees the buffer */
+	if (rmdir(kt.dir) < 0)
+		ERR("Couldn't remove %s: %s", kt.dir, strerror(errno));
+	free(events);
+	free(kt.xfers);
+	kt.xfers = NULL;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Cross-process bus arbitration through per-bus advisory locks
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "ft5x06.h"
+
+#define FT_LOCK_DIR		"/run/lock"
+#define FT_LOCK_DIR_FALLBACK	"/tmp"
+#define FT_LOCK_REPORT_MS	1	/* waits above that get logged */
+#define FT_LOCK_MAX_BUSES	8
+
+/*
+ * Locks are reentrant within a thread: protocol sequences take the lock
+ * for their whole duration and every transaction takes it again, so that
+ * one-shot accesses from another process can't sneak in the middle of a
+ * sequence. Nested takes only count, the flock is held by the outermost
+ * one. Threads of the process are serialized by the mutex, the flock
+ * does it between processes.
+ */
+struct bus_lock {
+	int fd;			/* i2c-dev fd the lock protects */
+	int lock_fd;
+	int bus;
+	pthread_mutex_t mutex;
+	/* Statistics below are updated by the holder only */
+	uint64_t acquired_ns;
+	uint32_t count;
+	uint32_t contended;
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_ns;
+	uint64_t hold_max_ns;
+};
+
+static struct bus_lock bus_locks[FT_LOCK_MAX_BUSES];
+static int bus_lock_count;
+static __thread int bus_lock_depth[FT_LOCK_MAX_BUSES];
+
+/* Registration happens before any thread starts */
+static struct bus_lock *bus_lock_find(int fd, int **depth)
+{
+	int i;
+
+	for (i = 0; i < bus_lock_count; i++) {
+		if (bus_locks[i].fd == fd) {
+			*depth = &bus_lock_depth[i];
+			return &bus_locks[i];
+		}
+	}
+
+	return NULL;
+}
+
+int ft5x06_bus_lock_register(int fd, int bus)
+{
+	struct bus_lock *lk;
+	char path[64];
+	struct stat st;
+
+	if (bus_lock_count >= FT_LOCK_MAX_BUSES)
+		return -ENOSPC;
+
+	snprintf(path, sizeof(path), "%s/ft5x06-i2c-%d.lock",
+		 stat(FT_LOCK_DIR, &st) == 0 ? FT_LOCK_DIR :
+		 FT_LOCK_DIR_FALLBACK, bus);
+
+	lk = &bus_locks[bus_lock_count];
+	memset(lk, 0, sizeof(*lk));
+	lk->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (lk->lock_fd < 0) {
+		ERR("Couldn't open %s, bus not arbitrated: %s", path,
+		    strerror(errno));
+		return -errno;
+	}
+	lk->fd = fd;
+	lk->bus = bus;
+	pthread_mutex_init(&lk->mutex, NULL);
+	bus_lock_count++;
+	DBG("Bus %d arbitrated through %s", bus, path);
+
+	return 0;
+}
+
+void ft5x06_bus_lock(int fd)
+{
+	int *depth;
+	struct bus_lock *lk = bus_lock_find(fd, &depth);
+	uint64_t start, waited;
+
+	if (!lk || (*depth)++ > 0)
+		return;
+
+	start = ft5x06_now_ns();
+	pthread_mutex_lock(&lk->mutex);
+	if (flock(lk->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+		lk->contended++;
+		while (flock(lk->lock_fd, LOCK_EX) < 0 && errno == EINTR)
+			;
+		ft5x06_trace_span("bus lock wait", start, "\"bus\":%d",
+				  lk->bus);
+	}
+	lk->acquired_ns = ft5x06_now_ns();
+
+	waited = lk->acquired_ns - start;
+	lk->count++;
+	lk->wait_ns += waited;
+	if (waited > lk->wait_max_ns)
+		lk->wait_max_ns = waited;
+	if (waited > FT_LOCK_REPORT_MS * 1000000ull)
+		LOG("Waited %.1f ms for bus %d", waited / 1e6, lk->bus);
+}
+
+/* Same without waiting, for callers that can't block: -EAGAIN if busy */
+int ft5x06_bus_trylock(int fd)
+{
+	int *depth;
+	struct bus_lock *lk = bus_lock_find(fd, &depth);
+
+	if (!lk || (*depth)++ > 0)
+		return 0;
+
+	if (pthread_mutex_trylock(&lk->mutex) != 0) {
+		(*depth)--;
+		return -EAGAIN;
+	}
+	if (flock(lk->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+		lk->contended++;
+		pthread_mutex_unlock(&lk->mutex);
+		(*depth)--;
+		return -EAGAIN;
+	}
+	lk->acquired_ns = ft5x06_now_ns();
+	lk->count++;
+
+	return 0;
+}
+
+void ft5x06_bus_unlock(int fd)
+{
+	int *depth;
+	struct bus_lock *lk = bus_lock_find(fd, &depth);
+	uint64_t held;
+
+	if (!lk || *depth == 0 || --(*depth) > 0)
+		return;
+
+	held = ft5x06_now_ns() - lk->acquired_ns;
+	lk->hold_ns += held;
+	if (held > lk->hold_max_ns)
+		lk->hold_max_ns = held;
+
+	flock(lk->lock_fd, LOCK_UN);
+	pthread_mutex_unlock(&lk->mutex);
+}
+
+void ft5x06_bus_lock_report(void)
+{
+	int i;
+
+	for (i = 0; i < bus_lock_count; i++) {
+		struct bus_lock *lk = &bus_locks[i];
+
+		if (!lk->count)
+			continue;
+		LOG("Bus %d lock: %u holds (%u contended), wait %.1f ms "
+		    "(max %.1f), hold %.1f ms (max %.1f)", lk->bus, lk->count,
+		    lk->contended, lk->wait_ns / 1e6, lk->wait_max_ns / 1e6,
+		    lk->hold_ns / 1e6, lk->hold_max_ns / 1e6);
+	}
+}
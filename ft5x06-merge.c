@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Tiled panels: two controllers merged into a single uinput device
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ft5x06.h"
+
+#define MERGE_TILES		2
+#define MERGE_SLOTS		(MERGE_TILES * FT_MAX_POINTS)
+#define MERGE_POLL_MS		10	/* without INT edge events */
+#define MERGE_STALE_PERIODS	3	/* partner data older is dropped */
+#define MERGE_COORD_MAX		4095	/* 12-bit controller coordinates */
+#define MERGE_EVENTS		(MERGE_SLOTS * 4 + 4)
+
+struct merge_tile {
+	int idx;
+	int fd;
+	int addr;
+	int max_points;
+	int gfd;
+	bool edge_events;
+	int x_off;
+	int y_off;
+	pthread_t thread;
+	bool started;
+
+	/* Published to the merger under merge.lock */
+	struct ft5x06_touch_frame frame;
+	uint64_t irq_ns;		/* INT edge, or polling time */
+	double period_ns;		/* report period estimate */
+	uint32_t frames;
+};
+
+struct merge_contact {
+	int tile;
+	uint8_t id;
+	int x;
+	int y;
+};
+
+/* One per uinput MT slot, the tracking ID survives seam crossings */
+struct merge_slot {
+	bool active;
+	bool seen;
+	int tile;
+	uint8_t id;
+	int tracking_id;
+	int x;
+	int y;
+	bool sent_active;
+	int sent_x;
+	int sent_y;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int pending;		/* tiles with a new frame */
+	unsigned int running;		/* tile readers not exited */
+	volatile bool stop;
+	struct merge_tile tiles[MERGE_TILES];
+	struct merge_slot slots[MERGE_SLOTS];
+	int next_id;
+	int seam2;			/* squared dedup distance */
+	int ufd;
+	uint32_t dups;
+	uint32_t handovers;
+} merge = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.ufd = -1,
+};
+
+/* Waits for the next report, false when asked to stop */
+static bool merge_tile_wait(struct merge_tile *t, uint64_t *irq_ns)
+{
+	struct pollfd pfd = { t->gfd, POLLIN, 0 };
+
+	if (t->gfd < 0 || !t->edge_events) {
+		msleep(MERGE_POLL_MS);
+		*irq_ns = ft5x06_now_ns();
+		return !merge.stop;
+	}
+
+	/* Timeout only so that the stop flag gets noticed */
+	while (!merge.stop) {
+		if (poll(&pfd, 1, 100) > 0)
+			return ft5x06_gpio_wait(t->gfd, true, 0, irq_ns) == 0;
+	}
+
+	return false;
+}
+
+/*
+ * One reader per controller: on separate buses the two reads of a frame
+ * pair overlap instead of adding up.
+ */
+static void *merge_tile_thread(void *arg)
+{
+	struct merge_tile *t = arg;
+	struct ft5x06_touch_frame frame;
+	uint64_t irq_ns, last_ns = 0;
+	char name[16];
+	int last_count = 0;
+
+	snprintf(name, sizeof(name), "tile %d", t->idx);
+	ft5x06_trace_meta("thread_name", name);
+	ft5x06_rt_setup(-1);
+
+	while (merge_tile_wait(t, &irq_ns)) {
+		uint64_t start = ft5x06_trace_start();
+
+		if (ft5x06_read_touch(t->fd, t->addr, &frame,
+				      t->max_points) < 0)
+			continue;
+		ft5x06_trace_span("tile read", start, "\"tile\":%d", t->idx);
+
+		/* Polled: only changes (and the lift) are worth merging */
+		if ((t->gfd < 0 || !t->edge_events) && !frame.count &&
+		    !last_count)
+			continue;
+		last_count = frame.count;
+
+		pthread_mutex_lock(&merge.lock);
+		if (last_ns && irq_ns - last_ns < 4 * t->period_ns)
+			t->period_ns += (irq_ns - last_ns - t->period_ns) / 16;
+		last_ns = irq_ns;
+		t->frame = frame;
+		t->irq_ns = irq_ns;
+		t->frames++;
+		merge.pending |= 1 << t->idx;
+		pthread_cond_signal(&merge.cond);
+		pthread_mutex_unlock(&merge.lock);
+	}
+
+	if (!merge.stop)
+		ERR("Tile %d reader stopped", t->idx);
+	/* The merger must not wait for frames that won't come */
+	pthread_mutex_lock(&merge.lock);
+	merge.running &= ~(1 << t->idx);
+	pthread_cond_signal(&merge.cond);
+	pthread_mutex_unlock(&merge.lock);
+
+	return NULL;
+}
+
+static int merge_uinput_open(int max_x, int max_y)
+{
+	static const int abs[] = {
+		ABS_X, ABS_Y, ABS_MT_SLOT, ABS_MT_TRACKING_ID,
+		ABS_MT_POSITION_X, ABS_MT_POSITION_Y,
+	};
+	struct uinput_user_dev dev;
+	int ufd, i;
+
+	ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (ufd < 0) {
+		ERR("Couldn't open /dev/uinput: %s", strerror(errno));
+		return -errno;
+	}
+
+	ioctl(ufd, UI_SET_EVBIT, EV_KEY);
+	ioctl(ufd, UI_SET_KEYBIT, BTN_TOUCH);
+	ioctl(ufd, UI_SET_EVBIT, EV_ABS);
+	for (i = 0; i < ARRAY_SIZE(abs); i++)
+		ioctl(ufd, UI_SET_ABSBIT, abs[i]);
+	ioctl(ufd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+
+	memset(&dev, 0, sizeof(dev));
+	snprintf(dev.name, sizeof(dev.name), "ft5x06 tiled touchscreen");
+	dev.id.bustype = BUS_VIRTUAL;
+	dev.absmax[ABS_X] = dev.absmax[ABS_MT_POSITION_X] = max_x;
+	dev.absmax[ABS_Y] = dev.absmax[ABS_MT_POSITION_Y] = max_y;
+	dev.absmax[ABS_MT_SLOT] = MERGE_SLOTS - 1;
+	dev.absmax[ABS_MT_TRACKING_ID] = 0xffff;
+
+	if (write(ufd, &dev, sizeof(dev)) != sizeof(dev) ||
+	    ioctl(ufd, UI_DEV_CREATE) < 0) {
+		ERR("Couldn't create uinput device: %s", strerror(errno));
+		close(ufd);
+		return -EIO;
+	}
+
+	return ufd;
+}
+
+static struct merge_slot *merge_nearest(const struct merge_contact *c)
+{
+	struct merge_slot *best = NULL;
+	int s, best_d2 = merge.seam2;
+
+	for (s = 0; s < MERGE_SLOTS; s++) {
+		struct merge_slot *sl = &merge.slots[s];
+		int dx = sl->x - c->x, dy = sl->y - c->y;
+
+		if (!sl->active || sl->tile == c->tile ||
+		    dx * dx + dy * dy > best_d2)
+			continue;
+		best = sl;
+		best_d2 = dx * dx + dy * dy;
+	}
+
+	return best;
+}
+
+/*
+ * Contacts keep the slot of their controller ID. A new contact close to
+ * a slot of the other controller is the same finger on the seam: dropped
+ * if that slot is still reported, taken over (same tracking ID) if not.
+ */
+static void merge_assign(struct merge_contact *c, int n)
+{
+	bool used[MERGE_SLOTS] = { false };
+	int i, s;
+
+	for (s = 0; s < MERGE_SLOTS; s++)
+		merge.slots[s].seen = false;
+
+	for (i = 0; i < n; i++) {
+		for (s = 0; s < MERGE_SLOTS; s++) {
+			struct merge_slot *sl = &merge.slots[s];
+
+			if (!sl->active || sl->seen || sl->tile != c[i].tile ||
+			    sl->id != c[i].id)
+				continue;
+			sl->x = c[i].x;
+			sl->y = c[i].y;
+			sl->seen = used[i] = true;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		struct merge_slot *sl;
+
+		if (used[i])
+			continue;
+
+		sl = merge_nearest(&c[i]);
+		if (sl && sl->seen) {
+			merge.dups++;
+			continue;
+		}
+		if (sl) {
+			merge.handovers++;
+		} else {
+			for (s = 0; s < MERGE_SLOTS; s++)
+				if (!merge.slots[s].active)
+					break;
+			if (s >= MERGE_SLOTS)
+				continue;
+			sl = &merge.slots[s];
+			sl->active = true;
+			sl->tracking_id = merge.next_id++ & 0xffff;
+		}
+		sl->tile = c[i].tile;
+		sl->id = c[i].id;
+		sl->x = c[i].x;
+		sl->y = c[i].y;
+		sl->seen = true;
+	}
+
+	for (s = 0; s < MERGE_SLOTS; s++)
+		if (!merge.slots[s].seen)
+			merge.slots[s].active = false;
+}
+
+static void merge_event(struct input_event *ev, int *n, int type, int code,
+			int value)
+{
+	memset(&ev[*n], 0, sizeof(ev[*n]));
+	ev[*n].type = type;
+	ev[*n].code = code;
+	ev[*n].value = value;
+	(*n)++;
+}
+
+/* Changed slots only, as a single write */
+static void merge_emit(void)
+{
+	struct input_event ev[MERGE_EVENTS];
+	struct merge_slot *first = NULL;
+	int s, n = 0;
+
+	for (s = 0; s < MERGE_SLOTS; s++) {
+		struct merge_slot *sl = &merge.slots[s];
+
+		if (sl->active && !first)
+			first = sl;
+		if (sl->active == sl->sent_active && (!sl->active ||
+		    (sl->x == sl->sent_x && sl->y == sl->sent_y)))
+			continue;
+
+		merge_event(ev, &n, EV_ABS, ABS_MT_SLOT, s);
+		if (sl->active != sl->sent_active)
+			merge_event(ev, &n, EV_ABS, ABS_MT_TRACKING_ID,
+				    sl->active ? sl->tracking_id : -1);
+		if (sl->active) {
+			merge_event(ev, &n, EV_ABS, ABS_MT_POSITION_X, sl->x);
+			merge_event(ev, &n, EV_ABS, ABS_MT_POSITION_Y, sl->y);
+		}
+		sl->sent_active = sl->active;
+		sl->sent_x = sl->x;
+		sl->sent_y = sl->y;
+	}
+	if (!n)
+		return;
+
+	merge_event(ev, &n, EV_KEY, BTN_TOUCH, !!first);
+	if (first) {
+		merge_event(ev, &n, EV_ABS, ABS_X, first->x);
+		merge_event(ev, &n, EV_ABS, ABS_Y, first->y);
+	}
+	merge_event(ev, &n, EV_SYN, SYN_REPORT, 0);
+
+	if (merge.ufd >= 0 &&
+	    write(merge.ufd, ev, n * sizeof(ev[0])) != n * sizeof(ev[0]))
+		DBG("uinput write failed: %s", strerror(errno));
+}
+
+/* The second tile, "<bus>:<addr>", shares the emulator if there is one */
+static int merge_tile_open(struct merge_tile *t, const char *spec,
+			   bool emulated)
+{
+	char dev[24];
+	int bus;
+
+	if (sscanf(spec, "%d:%x", &bus, &t->addr) != 2) {
+		ERR("Invalid tile %s (expected <bus>:<addr>)", spec);
+		return -EINVAL;
+	}
+	if (emulated) {
+		t->fd = -1;
+		return 0;
+	}
+
+	snprintf(dev, sizeof(dev), "/dev/i2c-%d", bus);
+	t->fd = open(dev, O_RDWR | O_CLOEXEC);
+	if (t->fd < 0) {
+		ERR("Couldn't open %s: %s", dev, strerror(errno));
+		return -errno;
+	}
+	if (ioctl(t->fd, I2C_SLAVE_FORCE, t->addr) != 0) {
+		ERR("Couldn't set slave addr: %s", strerror(errno));
+		close(t->fd);
+		return -errno;
+	}
+	ft5x06_bus_lock_register(t->fd, bus);
+
+	return 0;
+}
+
+static void merge_skew_report(struct ft5x06_lat *lat_phase)
+{
+	double p0 = merge.tiles[0].period_ns, p1 = merge.tiles[1].period_ns;
+	int i;
+
+	for (i = 0; i < MERGE_TILES; i++)
+		LOG("Tile %d: %u frames, %.2f Hz", i, merge.tiles[i].frames,
+		    merge.tiles[i].period_ns ?
+		    1e9 / merge.tiles[i].period_ns : 0);
+	if (p0 && p1)
+		LOG("Scan clock skew: tile 1 %+.0f ppm vs. tile 0",
+		    (p0 - p1) / p1 * 1e6);
+	ft5x06_lat_report(lat_phase, "Tile 1 frame after tile 0");
+}
+
+/*
+ * Reads both tiles from their own thread and merges on every new frame
+ * from either. The other tile's last frame is reused as long as it isn't
+ * older than a few of its periods: the controllers scan on their own
+ * clocks, so frame pairs drift against each other rather than align.
+ */
+int ft5x06_merge_run(int fd, int addr, int chip_id, const char *gpio,
+		     const char *tile, const char *tile_gpio,
+		     const char *offset, int seam, int count, int cpu)
+{
+	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	struct ft5x06_lat lat_merge = { 0 }, lat_age = { 0 }, lat_phase = { 0 };
+	struct merge_contact c[MERGE_SLOTS];
+	uint64_t last_irq0 = 0;
+	uint32_t merged = 0;
+	int i, j, ret;
+
+	if (info == NULL || count <= 0 || seam < 0)
+		return -EINVAL;
+
+	memset(merge.tiles, 0, sizeof(merge.tiles));
+	memset(merge.slots, 0, sizeof(merge.slots));
+	merge.tiles[0].fd = fd;
+	merge.tiles[0].addr = addr;
+	merge.tiles[1].gfd = merge.tiles[0].gfd = -1;
+	if (offset && sscanf(offset, "%d,%d", &merge.tiles[1].x_off,
+			     &merge.tiles[1].y_off) != 2) {
+		ERR("Invalid offset %s (expected <x>,<y>)", offset);
+		return -EINVAL;
+	}
+	ret = merge_tile_open(&merge.tiles[1], tile, fd < 0);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < MERGE_TILES && ret == 0; i++) {
+		struct merge_tile *t = &merge.tiles[i];
+		const char *spec = i ? tile_gpio : gpio;
+
+		t->idx = i;
+		t->max_points = info->tpd_max_points;
+		t->period_ns = 1e7;
+		if (!spec)
+			continue;
+		t->gfd = ft5x06_gpio_open(spec, &t->edge_events);
+		if (t->gfd < 0)
+			ret = t->gfd;
+		else if (!t->edge_events)
+			LOG("No edge events for %s, tile %d polled", spec, i);
+	}
+
+	merge.ufd = merge_uinput_open(MERGE_COORD_MAX + merge.tiles[1].x_off,
+				      MERGE_COORD_MAX + merge.tiles[1].y_off);
+	if (merge.ufd < 0)
+		LOG("Merging without input device");
+	merge.seam2 = seam * seam;
+	merge.next_id = 1;
+	merge.dups = merge.handovers = 0;
+	merge.pending = merge.running = 0;
+	merge.stop = false;
+
+	if (ret == 0 && (ft5x06_lat_init(&lat_merge, count) < 0 ||
+			 ft5x06_lat_init(&lat_age, count) < 0 ||
+			 ft5x06_lat_init(&lat_phase, count) < 0))
+		ret = -ENOMEM;
+
+	for (i = 0; i < MERGE_TILES && ret == 0; i++) {
+		merge.running |= 1 << i;
+		ret = -pthread_create(&merge.tiles[i].thread, NULL,
+				      merge_tile_thread, &merge.tiles[i]);
+		merge.tiles[i].started = (ret == 0);
+		if (ret)
+			merge.running &= ~(1 << i);
+	}
+	ft5x06_rt_setup(cpu);
+
+	LOG("Merging %d frames, tile 1 at %d,%d, seam distance %d", count,
+	    merge.tiles[1].x_off, merge.tiles[1].y_off, seam);
+	while (ret == 0 && merged < count) {
+		struct merge_tile snap[MERGE_TILES];
+		unsigned int pending;
+		uint64_t now, irq = 0;
+		int n = 0;
+
+		pthread_mutex_lock(&merge.lock);
+		while (!merge.pending && merge.running)
+			pthread_cond_wait(&merge.cond, &merge.lock);
+		if (!merge.pending) {
+			pthread_mutex_unlock(&merge.lock);
+			ret = -EIO;
+			break;
+		}
+		pending = merge.pending;
+		merge.pending = 0;
+		memcpy(snap, merge.tiles, sizeof(snap));
+		pthread_mutex_unlock(&merge.lock);
+
+		now = ft5x06_now_ns();
+		for (i = 0; i < MERGE_TILES; i++) {
+			struct merge_tile *t = &snap[i];
+
+			if (pending & (1 << i)) {
+				if (!irq || t->irq_ns < irq)
+					irq = t->irq_ns;
+			} else if (!t->irq_ns || now - t->irq_ns >
+				   MERGE_STALE_PERIODS * t->period_ns) {
+				continue;
+			} else if (t->frame.count) {
+				ft5x06_lat_add(&lat_age, now - t->irq_ns);
+			}
+
+			for (j = 0; j < t->frame.count; j++) {
+				struct ft5x06_touch_point *p = &t->frame.p[j];
+
+				if (p->event == FT_TOUCH_EVENT_UP)
+					continue;
+				c[n].tile = i;
+				c[n].id = p->id;
+				c[n].x = p->x + t->x_off;
+				c[n].y = p->y + t->y_off;
+				n++;
+			}
+		}
+		/* Phase of the tile 1 scans within the tile 0 period */
+		if ((pending & 2) && last_irq0 && snap[1].irq_ns >= last_irq0 &&
+		    snap[1].irq_ns - last_irq0 < 2 * snap[0].period_ns)
+			ft5x06_lat_add(&lat_phase, snap[1].irq_ns - last_irq0);
+		if (pending & 1)
+			last_irq0 = snap[0].irq_ns;
+
+		merge_assign(c, n);
+		merge_emit();
+		ft5x06_lat_add(&lat_merge, ft5x06_now_ns() - irq);
+		merged++;
+	}
+
+	merge.stop = true;
+	for (i = 0; i < MERGE_TILES; i++)
+		if (merge.tiles[i].started)
+			pthread_join(merge.tiles[i].thread, NULL);
+
+	/* Lift whatever is still down */
+	merge_assign(c, 0);
+	merge_emit();
+
+	LOG("Merged frames %u, seam duplicates %u, handovers %u", merged,
+	    merge.dups, merge.handovers);
+	merge_skew_report(&lat_phase);
+	ft5x06_lat_report(&lat_merge, "Merged frame (INT to uinput)");
+	ft5x06_lat_report(&lat_age, "Partner tile data age");
+
+	ft5x06_lat_free(&lat_merge);
+	ft5x06_lat_free(&lat_age);
+	ft5x06_lat_free(&lat_phase);
+	if (merge.ufd >= 0) {
+		ioctl(merge.ufd, UI_DEV_DESTROY);
+		close(merge.ufd);
+	}
+	for (i = 0; i < MERGE_TILES; i++)
+		if (merge.tiles[i].gfd >= 0)
+			close(merge.tiles[i].gfd);
+	if (merge.tiles[1].fd >= 0)
+		close(merge.tiles[1].fd);
+
+	return ret;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Latency statistics and real-time helpers for the measurement modes
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ft5x06.h"
+
+int ft5x06_lat_init(struct ft5x06_lat *lat, uint32_t size)
+{
+	/* Allocated and touched up front so adding samples never faults */
+	lat->ns = calloc(size, sizeof(*lat->ns));
+	lat->count = 0;
+	lat->size = lat->ns ? size : 0;
+	if (!lat->ns) {
+		ERR("Couldn't allocate %u latency samples", size);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void ft5x06_lat_free(struct ft5x06_lat *lat)
+{
+	free(lat->ns);
+	lat->ns = NULL;
+	lat->count = lat->size = 0;
+}
+
+static int ft5x06_lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double ft5x06_lat_pct(struct ft5x06_lat *lat, int pct)
+{
+	return lat->ns[(uint64_t)(lat->count - 1) * pct / 100] / 1000.0;
+}
+
+/* Sorts the samples in place, all values are reported in microseconds */
+void ft5x06_lat_report(struct ft5x06_lat *lat, const char *name)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+
+	if (lat->count == 0) {
+		LOG("%-24s no samples", name);
+		return;
+	}
+
+	qsort(lat->ns, lat->count, sizeof(*lat->ns), ft5x06_lat_cmp);
+	for (i = 0; i < lat->count; i++)
+		sum += lat->ns[i];
+
+	LOG("%-24s n=%u min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f "
+	    "mean=%.1f (us)", name, lat->count, lat->ns[0] / 1000.0,
+	    ft5x06_lat_pct(lat, 50), ft5x06_lat_pct(lat, 90),
+	    ft5x06_lat_pct(lat, 99), lat->ns[lat->count - 1] / 1000.0,
+	    sum / 1000.0 / lat->count);
+}
+
+/*
+ * Pins the calling thread on a CPU (if cpu >= 0), switches it to
+ * SCHED_FIFO and locks the process memory. Failures are not fatal, the
+ * measurement is simply noisier without them.
+ */
+int ft5x06_rt_setup(int cpu)
+{
+	struct sched_param param = { .sched_priority = 50 };
+	int ret = 0;
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			ERR("Couldn't pin to CPU %d: %s", cpu, strerror(errno));
+			ret = -errno;
+		}
+	}
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		DBG("Couldn't switch to SCHED_FIFO: %s", strerror(errno));
+		ret = -errno;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		DBG("Couldn't lock memory: %s", strerror(errno));
+		ret = -errno;
+	}
+
+	return ret;
+}
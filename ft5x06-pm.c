@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Adapter runtime PM: keeps the I2C controller resumed while we use it
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+/*
+ * The controller (parent of the adapter device) is the one that runtime
+ * suspends, its power/control is "auto" unless pinned to "on".
+ */
+static struct {
+	char dir[96];
+	char saved[8];
+	bool pinned;
+} pm;
+
+static int pm_read(const char *file, char *buf, int len)
+{
+	char path[128];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", pm.dir, file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return ret;
+}
+
+static int pm_write(const char *file, const char *val)
+{
+	char path[128];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", pm.dir, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, val, strlen(val)) != strlen(val))
+		ret = -errno;
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+static void pm_set_bus(int bus)
+{
+	snprintf(pm.dir, sizeof(pm.dir),
+		 "/sys/class/i2c-adapter/i2c-%d/device/power", bus);
+}
+
+static long pm_suspended_ms(void)
+{
+	char buf[32];
+
+	if (pm_read("runtime_suspended_time", buf, sizeof(buf)) < 0)
+		return -1;
+
+	return strtol(buf, NULL, 10);
+}
+
+int ft5x06_pm_pin(int bus)
+{
+	char status[16] = "?", delay[16] = "?";
+	int ret;
+
+	/* Pinning again would save "on" as the value to restore */
+	if (pm.pinned)
+		return 0;
+
+	pm_set_bus(bus);
+	ret = pm_read("control", pm.saved, sizeof(pm.saved));
+	if (ret < 0) {
+		ERR("No runtime PM control for i2c-%d", bus);
+		return ret;
+	}
+	pm_read("runtime_status", status, sizeof(status));
+	pm_read("autosuspend_delay_ms", delay, sizeof(delay));
+
+	ret = pm_write("control", "on");
+	if (ret < 0) {
+		ERR("Couldn't pin i2c-%d controller: %s", bus, strerror(-ret));
+		return ret;
+	}
+	pm.pinned = true;
+	LOG("i2c-%d controller pinned on (was %s, %s, autosuspend %s ms)",
+	    bus, pm.saved, status, delay);
+
+	return 0;
+}
+
+void ft5x06_pm_restore(void)
+{
+	if (!pm.pinned)
+		return;
+
+	if (pm_write("control", pm.saved) < 0)
+		ERR("Couldn't restore %s/control to %s", pm.dir, pm.saved);
+	pm.pinned = false;
+}
+
+/*
+ * Register reads spaced the way the flash procedures space them, first
+ * with the controller left to runtime PM, then pinned. A pin done with
+ * --pm-pin is lifted for the first pass and put back at the end.
+ */
+int ft5x06_pm_bench(int fd, int addr, int bus, int count)
+{
+	/* Flash status polls and dump read pacing */
+	static const int gaps[] = { 5, 10 };
+	struct ft5x06_lat lat;
+	char name[32];
+	uint8_t val;
+	bool was_pinned = pm.pinned;
+	int pinned, i, j, ret;
+
+	if (count <= 0)
+		return -EINVAL;
+	ret = ft5x06_lat_init(&lat, count);
+	if (ret < 0)
+		return ret;
+	ft5x06_pm_restore();
+	pm_set_bus(bus);
+
+	for (pinned = 0; pinned < 2; pinned++) {
+		if (pinned && ft5x06_pm_pin(bus) < 0)
+			break;
+
+		for (i = 0; i < ARRAY_SIZE(gaps); i++) {
+			long suspended = pm_suspended_ms();
+
+			lat.count = 0;
+			for (j = 0; j < count; j++) {
+				uint64_t t;
+
+				msleep(gaps[i]);
+				t = ft5x06_now_ns();
+				ret = ft5x06_read_regs(fd, addr, ID_G_FIRMID,
+						       &val, 1);
+				if (ret >= 0)
+					ft5x06_lat_add(&lat,
+						       ft5x06_now_ns() - t);
+			}
+
+			snprintf(name, sizeof(name), "%s, %d ms gaps",
+				 pinned ? "pinned" : "runtime PM", gaps[i]);
+			ft5x06_lat_report(&lat, name);
+			if (suspended >= 0)
+				LOG("Controller suspended %ld ms of %d",
+				    pm_suspended_ms() - suspended,
+				    count * gaps[i]);
+		}
+
+		if (pinned)
+			ft5x06_pm_restore();
+	}
+
+	ft5x06_lat_free(&lat);
+	if (was_pinned)
+		ft5x06_pm_pin(bus);
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Touch polling for boards without a usable INT line
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/timerfd.h>
+
+#include "ft5x06.h"
+
+#define POLL_DEFAULT_HZ		100	/* when ID_G_PERIODACTIVE is off */
+#define POLL_LINGER_MS		100	/* empty reports before going idle */
+#define POLL_MAX_CONTACTS	4096
+
+enum poll_state {
+	POLL_IDLE,
+	POLL_ACTIVE,
+	POLL_STATES,
+};
+
+struct poll_stats {
+	uint64_t polls;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+};
+
+static uint64_t poll_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int poll_arm(int tfd, uint64_t period_ns)
+{
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = period_ns / 1000000000ull;
+	its.it_interval.tv_nsec = period_ns % 1000000000ull;
+	its.it_value = its.it_interval;
+
+	return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+/*
+ * Polls TD_STATUS alone at the idle period. On the first contact it
+ * switches right away to full frame reads at the panel report rate and
+ * goes back to idle after POLL_LINGER_MS of empty reports.
+ *
+ * A real controller doesn't tell when the finger came down, so the time
+ * since the previous poll is only an upper bound of the first touch
+ * latency. onset_ns, when not NULL, gives the true start of the touch
+ * (emulator) and the exact latency is reported as well.
+ */
+int ft5x06_poll_run(int fd, int addr, int chip_id, int seconds, int idle_ms,
+		    int cpu, uint64_t (*onset_ns)(void))
+{
+	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	struct poll_stats stats[POLL_STATES] = { { 0 } };
+	struct ft5x06_lat lat_gap, lat_true;
+	struct ft5x06_touch_frame frame;
+	enum poll_state state = POLL_IDLE;
+	uint64_t active_ns, idle_ns, expirations, missed = 0;
+	uint64_t now, end, last_poll, state_ns, state_cpu, down;
+	uint32_t contacts = 0, frames = 0;
+	uint8_t rate = 0, status;
+	int tfd, empty = 0, linger, ret;
+
+	if (info == NULL || seconds <= 0 || idle_ms <= 0)
+		return -EINVAL;
+
+	if (ft5x06_read_regs(fd, addr, ID_G_PERIODACTIVE, &rate, 1) < 0 ||
+	    rate == 0)
+		rate = POLL_DEFAULT_HZ / 10;
+	active_ns = 1000000000ull / (rate * 10);
+	idle_ns = idle_ms * 1000000ull;
+	linger = POLL_LINGER_MS * 1000000ull / active_ns;
+	LOG("Polling for %d s: idle every %d ms, active at %d Hz", seconds,
+	    idle_ms, rate * 10);
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		ERR("Couldn't create timer: %s", strerror(errno));
+		return -errno;
+	}
+	ft5x06_lat_init(&lat_gap, POLL_MAX_CONTACTS);
+	ft5x06_lat_init(&lat_true, POLL_MAX_CONTACTS);
+	ft5x06_rt_setup(cpu);
+
+	now = ft5x06_now_ns();
+	end = now + seconds * 1000000000ull;
+	last_poll = state_ns = now;
+	state_cpu = poll_cpu_ns();
+	ret = poll_arm(tfd, idle_ns);
+
+	while (ret == 0 && now < end) {
+		if (read(tfd, &expirations, sizeof(expirations)) !=
+		    sizeof(expirations))
+			break;
+		missed += expirations - 1;
+		stats[state].polls++;
+
+		if (state == POLL_IDLE) {
+			ret = ft5x06_read_regs(fd, addr, ID_G_TD_STATUS,
+					       &status, 1);
+			now = ft5x06_now_ns();
+			if (ret < 0 || !(status & 0x0f)) {
+				last_poll = now;
+				ret = 0;
+				continue;
+			}
+
+			/* The touch happened somewhere since the last poll */
+			contacts++;
+			ft5x06_lat_add(&lat_gap, now - last_poll);
+			down = onset_ns ? onset_ns() : 0;
+			if (down && down <= now)
+				ft5x06_lat_add(&lat_true, now - down);
+
+			stats[state].wall_ns += now - state_ns;
+			stats[state].cpu_ns += poll_cpu_ns() - state_cpu;
+			state = POLL_ACTIVE;
+			state_ns = now;
+			state_cpu = poll_cpu_ns();
+			ret = poll_arm(tfd, active_ns);
+			empty = 0;
+		}
+
+		/* Burst read of TD_STATUS and every point slot */
+		if (ft5x06_read_touch(fd, addr, &frame,
+				      info->tpd_max_points) > 0) {
+			frames++;
+			empty = 0;
+		} else {
+			empty++;
+		}
+		now = last_poll = ft5x06_now_ns();
+
+		if (empty > linger) {
+			stats[state].wall_ns += now - state_ns;
+			stats[state].cpu_ns += poll_cpu_ns() - state_cpu;
+			state = POLL_IDLE;
+			state_ns = now;
+			state_cpu = poll_cpu_ns();
+			ret = poll_arm(tfd, idle_ns);
+		}
+	}
+	stats[state].wall_ns += ft5x06_now_ns() - state_ns;
+	stats[state].cpu_ns += poll_cpu_ns() - state_cpu;
+	close(tfd);
+
+	LOG("Contacts %u, frames %u, missed ticks %llu", contacts, frames,
+	    (unsigned long long)missed);
+	LOG("Idle:   %6.2f s, %7llu polls, CPU %.2f%%",
+	    stats[POLL_IDLE].wall_ns / 1e9,
+	    (unsigned long long)stats[POLL_IDLE].polls,
+	    stats[POLL_IDLE].wall_ns ? 100.0 * stats[POLL_IDLE].cpu_ns /
+	    stats[POLL_IDLE].wall_ns : 0);
+	LOG("Active: %6.2f s, %7llu polls, CPU %.2f%%",
+	    stats[POLL_ACTIVE].wall_ns / 1e9,
+	    (unsigned long long)stats[POLL_ACTIVE].polls,
+	    stats[POLL_ACTIVE].wall_ns ? 100.0 * stats[POLL_ACTIVE].cpu_ns /
+	    stats[POLL_ACTIVE].wall_ns : 0);
+	LOG("Overall CPU %.2f%%", 100.0 * (stats[POLL_IDLE].cpu_ns +
+	    stats[POLL_ACTIVE].cpu_ns) / (stats[POLL_IDLE].wall_ns +
+	    stats[POLL_ACTIVE].wall_ns));
+	ft5x06_lat_report(&lat_gap, "First touch, upper bound (poll gap)");
+	if (lat_true.count)
+		ft5x06_lat_report(&lat_true, "First touch, emulated");
+
+	ft5x06_lat_free(&lat_gap);
+	ft5x06_lat_free(&lat_true);
+	return ret;
+}
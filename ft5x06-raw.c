@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Factory mode raw capacitance data access
+ */
+
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "ft5x06.h"
+
+/* Row select, data register and data read chained in one transfer */
+#define RAW_ROWS_PER_XFER	(I2C_RDWR_IOCTL_MAX_MSGS / 3)
+
+int ft5x06_factory_enter(int fd, int addr, struct ft5x06_raw_info *raw)
+{
+	uint8_t mode = 0;
+	int i;
+
+	ft5x06_write_reg(fd, addr, ID_G_DEVICE_MODE, FT_MODE_FACTORY);
+	for (i = 0; i < FT_FACTORY_TRIES; i++) {
+		msleep(20);
+		if (ft5x06_read_regs(fd, addr, ID_G_DEVICE_MODE, &mode,
+				     1) >= 0 &&
+		    (mode & 0x70) == FT_MODE_FACTORY)
+			break;
+	}
+	if (i >= FT_FACTORY_TRIES) {
+		ERR("Couldn't enter factory mode (%02x)", mode);
+		return -EIO;
+	}
+
+	/* Entered from here on, failures leave it again */
+	if (ft5x06_read_regs(fd, addr, FT_FACTORY_TX_NUM, &raw->tx, 1) < 0 ||
+	    ft5x06_read_regs(fd, addr, FT_FACTORY_RX_NUM, &raw->rx, 1) < 0) {
+		ft5x06_factory_exit(fd, addr);
+		return -EIO;
+	}
+
+	if (!raw->tx || !raw->rx || raw->tx > FT_RAW_MAX_TX ||
+	    raw->rx > FT_RAW_MAX_RX) {
+		ERR("Unexpected node count %dx%d", raw->tx, raw->rx);
+		ft5x06_factory_exit(fd, addr);
+		return -ERANGE;
+	}
+
+	LOG("Factory mode, %d TX x %d RX nodes", raw->tx, raw->rx);
+	return 0;
+}
+
+int ft5x06_factory_exit(int fd, int addr)
+{
+	ft5x06_write_reg(fd, addr, ID_G_DEVICE_MODE, FT_MODE_WORK);
+	msleep(50);
+
+	return 0;
+}
+
+static int raw_scan(int fd, int addr)
+{
+	uint8_t mode = 0;
+	int i, ret;
+
+	ft5x06_write_reg(fd, addr, ID_G_DEVICE_MODE,
+			 FT_MODE_FACTORY | FT_MODE_START_SCAN);
+	for (i = 0; i < FT_FACTORY_TRIES * 10; i++) {
+		msleep(2);
+		ret = ft5x06_read_regs(fd, addr, ID_G_DEVICE_MODE, &mode, 1);
+		if (ret >= 0 && !(mode & FT_MODE_START_SCAN))
+			return 0;
+	}
+
+	ERR("Scan didn't complete (%02x)", mode);
+	return -ETIMEDOUT;
+}
+
+/*
+ * Triggers one scan and reads it back, one RX row burst per TX line.
+ * Frames are stored row-major (tx * rx) in native endianness.
+ */
+int ft5x06_raw_read(int fd, int addr, const struct ft5x06_raw_info *raw,
+		    uint16_t *frame)
+{
+	uint8_t buf[FT_RAW_MAX_RX * 2];
+	uint8_t reg;
+	int i, j, ret;
+
+	ret = raw_scan(fd, addr);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < raw->tx; i++) {
+		ft5x06_write_reg(fd, addr, FT_FACTORY_ROW_ADDR, i);
+		reg = FT_FACTORY_RAW_DATA;
+		ret = ft5x06_i2c_read(fd, addr, &reg, 1, buf, raw->rx * 2);
+		if (ret < 0)
+			return ret;
+		for (j = 0; j < raw->rx; j++)
+			frame[i * raw->rx + j] = (buf[2 * j] << 8) |
+						 buf[2 * j + 1];
+	}
+
+	return 0;
+}
+
+/*
+ * Same as ft5x06_raw_read(), but up to RAW_ROWS_PER_XFER rows are read
+ * per transfer, saving a stop/start and a system call per access.
+ */
+int ft5x06_raw_read_bulk(int fd, int addr, const struct ft5x06_raw_info *raw,
+			 uint16_t *frame)
+{
+	static uint8_t reg = FT_FACTORY_RAW_DATA;
+	uint8_t sel[FT_RAW_MAX_TX][2];
+	uint8_t buf[FT_RAW_MAX_TX][FT_RAW_MAX_RX * 2];
+	struct i2c_msg msgs[RAW_ROWS_PER_XFER * 3];
+	struct i2c_rdwr_ioctl_data data = { msgs, 0 };
+	uint64_t t;
+	int i, j, ret;
+
+	ret = raw_scan(fd, addr);
+	if (ret < 0)
+		return ret;
+
+	ft5x06_bus_lock(fd);
+	for (i = 0; i < raw->tx; i++) {
+		sel[i][0] = FT_FACTORY_ROW_ADDR;
+		sel[i][1] = i;
+		msgs[data.nmsgs++] = (struct i2c_msg){ addr, 0, 2, sel[i] };
+		msgs[data.nmsgs++] = (struct i2c_msg){ addr, 0, 1, &reg };
+		msgs[data.nmsgs++] = (struct i2c_msg){ addr, I2C_M_RD,
+						       raw->rx * 2, buf[i] };
+		if (data.nmsgs < ARRAY_SIZE(msgs) && i + 1 < raw->tx)
+			continue;
+
+		t = ft5x06_trace_start();
+		ret = ft5x06_transport_xfer(ft5x06_get_transport(), fd, &data);
+		ft5x06_trace_span("i2c bulk", t, "\"msgs\":%u", data.nmsgs);
+		if (ret < 0) {
+			ERR("Error %d", ret);
+			break;
+		}
+		data.nmsgs = 0;
+	}
+	ft5x06_bus_unlock(fd);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < raw->tx; i++)
+		for (j = 0; j < raw->rx; j++)
+			frame[i * raw->rx + j] = (buf[i][2 * j] << 8) |
+						 buf[i][2 * j + 1];
+
+	return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Production self-test: open/short/noise/uniformity checks on raw data
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+#define ST_NODES		(FT_RAW_MAX_TX * FT_RAW_MAX_RX)
+#define ST_DEFAULT_FRAMES	8
+#define ST_MAX_FRAMES		64
+
+#define ST_OPEN			0x01	/* mean below raw_min */
+#define ST_SHORT		0x02	/* mean above raw_max */
+#define ST_NOISE		0x04	/* peak to peak above noise_max */
+#define ST_UNIFORM		0x08	/* too far from a neighbour */
+#define ST_CHECKS		4
+
+static const char st_codes[ST_CHECKS] = { 'O', 'S', 'N', 'U' };
+static const char * const st_names[ST_CHECKS] = {
+	"open", "short", "noise", "uniformity"
+};
+
+/* Per node limits, a single value in the file applies to all nodes */
+struct st_limits {
+	int frames;
+	int uniformity;			/* percent, 0 disables the check */
+	int32_t raw_min[ST_NODES];
+	int32_t raw_max[ST_NODES];
+	int32_t noise_max[ST_NODES];
+};
+
+static int st_set(struct st_limits *lim, const char *key,
+		  const int32_t *vals, int n, int nodes)
+{
+	int32_t *arr = NULL;
+	int i;
+
+	if (strcmp(key, "frames") == 0 && n == 1 && vals[0] > 0 &&
+	    vals[0] <= ST_MAX_FRAMES) {
+		lim->frames = vals[0];
+		return 0;
+	}
+	if (strcmp(key, "uniformity") == 0 && n == 1 && vals[0] >= 0) {
+		lim->uniformity = vals[0];
+		return 0;
+	}
+
+	if (strcmp(key, "raw_min") == 0)
+		arr = lim->raw_min;
+	else if (strcmp(key, "raw_max") == 0)
+		arr = lim->raw_max;
+	else if (strcmp(key, "noise_max") == 0)
+		arr = lim->noise_max;
+	if (!arr || (n != 1 && n != nodes)) {
+		ERR("Invalid limit %s (%d values, %d nodes)", key, n, nodes);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nodes; i++)
+		arr[i] = vals[n == 1 ? 0 : i];
+
+	return 0;
+}
+
+/*
+ * Limits file: a keyword followed by its values, either one for all the
+ * nodes or one per node in row-major (TX by RX) order. '#' starts a
+ * comment. For instance:
+ *   frames 8
+ *   raw_min 3000
+ *   raw_max 7000
+ *   noise_max 60
+ *   uniformity 20
+ */
+static int st_parse(const char *path, struct st_limits *lim, int nodes)
+{
+	FILE *f = fopen(path, "r");
+	char key[32] = "", *line = NULL, *tok, *save, *end;
+	int32_t *vals;
+	size_t size = 0;
+	int n = 0, ret = 0;
+
+	if (!f) {
+		ERR("Unable to open file %s", path);
+		return -ENOENT;
+	}
+	vals = malloc(ST_NODES * sizeof(*vals));
+	if (!vals) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	while (ret == 0 && getline(&line, &size, f) > 0) {
+		tok = strchr(line, '#');
+		if (tok)
+			*tok = '\0';
+
+		for (tok = strtok_r(line, " \t\r\n,", &save); tok && !ret;
+		     tok = strtok_r(NULL, " \t\r\n,", &save)) {
+			long v = strtol(tok, &end, 0);
+
+			if (*end != '\0') {
+				if (key[0])
+					ret = st_set(lim, key, vals, n, nodes);
+				snprintf(key, sizeof(key), "%s", tok);
+				n = 0;
+			} else if (!key[0] || n >= ST_NODES) {
+				ERR("Unexpected value %s", tok);
+				ret = -EINVAL;
+			} else {
+				vals[n++] = v;
+			}
+		}
+	}
+	if (ret == 0 && key[0])
+		ret = st_set(lim, key, vals, n, nodes);
+
+	free(line);
+	free(vals);
+	fclose(f);
+	return ret;
+}
+
+static bool st_far(int32_t a, int32_t b, int pct)
+{
+	int32_t d = a > b ? a - b : b - a;
+
+	return d * 100 > pct * (a > b ? a : b);
+}
+
+/*
+ * Straight loops over all the nodes so that the compiler vectorizes
+ * them. Sums are compared against limits scaled by the frame count
+ * rather than divided.
+ */
+static void st_eval(const uint16_t *frames, int nframes, int tx, int rx,
+		    const struct st_limits *lim, uint8_t *fail)
+{
+	int32_t sum[ST_NODES], lo[ST_NODES], hi[ST_NODES];
+	int nodes = tx * rx;
+	int f, i, j;
+
+	for (i = 0; i < nodes; i++) {
+		sum[i] = 0;
+		lo[i] = 0xffff;
+		hi[i] = 0;
+	}
+
+	for (f = 0; f < nframes; f++) {
+		const uint16_t *p = frames + f * nodes;
+
+		for (i = 0; i < nodes; i++) {
+			int32_t v = p[i];
+
+			sum[i] += v;
+			lo[i] = v < lo[i] ? v : lo[i];
+			hi[i] = v > hi[i] ? v : hi[i];
+		}
+	}
+
+	for (i = 0; i < nodes; i++)
+		fail[i] = (sum[i] < lim->raw_min[i] * nframes) * ST_OPEN |
+			  (sum[i] > lim->raw_max[i] * nframes) * ST_SHORT |
+			  (hi[i] - lo[i] > lim->noise_max[i]) * ST_NOISE;
+
+	if (!lim->uniformity)
+		return;
+
+	/* Both nodes of a pair get flagged, along RX then along TX */
+	for (i = 0; i < tx; i++) {
+		for (j = 0; j < rx; j++) {
+			int n = i * rx + j;
+
+			if (j + 1 < rx &&
+			    st_far(sum[n], sum[n + 1], lim->uniformity)) {
+				fail[n] |= ST_UNIFORM;
+				fail[n + 1] |= ST_UNIFORM;
+			}
+			if (i + 1 < tx &&
+			    st_far(sum[n], sum[n + rx], lim->uniformity)) {
+				fail[n] |= ST_UNIFORM;
+				fail[n + rx] |= ST_UNIFORM;
+			}
+		}
+	}
+}
+
+static void st_report(const uint8_t *fail, int tx, int rx)
+{
+	int count[ST_CHECKS] = { 0 };
+	char row[FT_RAW_MAX_RX + 1];
+	int i, j, k;
+
+	LOG("Failure map (. pass, O open, S short, N noise, U uniformity):");
+	for (i = 0; i < tx; i++) {
+		for (j = 0; j < rx; j++) {
+			uint8_t flags = fail[i * rx + j];
+
+			row[j] = '.';
+			for (k = ST_CHECKS - 1; k >= 0; k--) {
+				if (!(flags & (1 << k)))
+					continue;
+				row[j] = st_codes[k];
+				count[k]++;
+			}
+		}
+		row[rx] = '\0';
+		LOG("TX%02d %s", i, row);
+	}
+
+	for (k = 0; k < ST_CHECKS; k++)
+		if (count[k])
+			LOG("%d node(s) failed the %s check", count[k],
+			    st_names[k]);
+}
+
+/* Returns the number of failing nodes, or a negative error */
+int ft5x06_selftest(int fd, int addr, const char *limits)
+{
+	struct ft5x06_raw_info raw;
+	struct st_limits *lim;
+	uint16_t *frames = NULL;
+	uint8_t fail[ST_NODES];
+	uint64_t t0, t1, t2, t3;
+	int i, nodes, failed = 0, ret;
+
+	lim = calloc(1, sizeof(*lim));
+	if (!lim)
+		return -ENOMEM;
+
+	t0 = ft5x06_now_ns();
+	ret = ft5x06_factory_enter(fd, addr, &raw);
+	if (ret < 0)
+		goto out;
+	nodes = raw.tx * raw.rx;
+
+	lim->frames = ST_DEFAULT_FRAMES;
+	for (i = 0; i < nodes; i++) {
+		lim->raw_max[i] = 0xffff;
+		lim->noise_max[i] = 0xffff;
+	}
+	ret = st_parse(limits, lim, nodes);
+	frames = malloc(lim->frames * nodes * sizeof(*frames));
+	if (ret < 0 || !frames) {
+		ret = ret < 0 ? ret : -ENOMEM;
+		ft5x06_factory_exit(fd, addr);
+		goto out;
+	}
+
+	t1 = ft5x06_now_ns();
+	for (i = 0; i < lim->frames && ret == 0; i++)
+		ret = ft5x06_raw_read_bulk(fd, addr, &raw, frames + i * nodes);
+	t2 = ft5x06_now_ns();
+	if (ret == 0)
+		st_eval(frames, lim->frames, raw.tx, raw.rx, lim, fail);
+	t3 = ft5x06_now_ns();
+	ft5x06_factory_exit(fd, addr);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < nodes; i++)
+		failed += !!fail[i];
+	st_report(fail, raw.tx, raw.rx);
+
+	LOG("%s: %d/%d nodes failed", failed ? "FAIL" : "PASS", failed,
+	    nodes);
+	LOG("Time: setup %.1f ms, acquisition %.1f ms (%d frames), "
+	    "evaluation %.1f us, total %.1f ms", (t1 - t0) / 1e6,
+	    (t2 - t1) / 1e6, lim->frames, (t3 - t2) / 1e3,
+	    (ft5x06_now_ns() - t0) / 1e6);
+	ret = failed;
+out:
+	free(frames);
+	free(lim);
+	return ret;
+}
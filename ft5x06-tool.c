@@ -10,9 +10,7 @@
 #include <fcntl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
-#include <stdbool.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -21,111 +19,51 @@
 #include <sys/time.h>
 #include <unistd.h>
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-
-/* Documented registers */
-#define ID_G_THGROUP		0x80
-#define ID_G_THPEAK		0x81
-#define ID_G_THCAL		0x82
-#define ID_G_THWATER		0x83
-#define ID_G_THTEMP		0x84
-#define ID_G_CTRL		0x86
-#define ID_G_TIME_ENTER_MONITOR	0x87
-#define ID_G_PERIODACTIVE	0x88
-#define ID_G_PERIODMONITOR	0x89
-#define ID_G_AUTO_CLB_MODE	0xa0
-#define ID_G_LIB_VERSION_H	0xa1
-#define ID_G_LIB_VERSION_L	0xa2
-#define ID_G_CIPHER		0xa3
-#define ID_G_MODE		0xa4
-#define ID_G_FIRMID		0xa6
-#define ID_G_FT5201ID		0xa8
-#define ID_G_ERR		0xa9
-#define ID_G_CLB		0xaa
-#define ID_G_B_AREA_TH		0xae
-#define FT5x06_MAX_REG_OFFSET	0xae
-
-/* Undocumented registers */
-#define FT_FW_READ_REG		0x03
-#define FT_REG_RESET_FW		0x07
-#define FT_ERASE_APP_REG	0x61
-#define FT_ERASE_PANEL_REG	0x63
-#define FT_FLASH_STATUS		0x6a
-#define FT_PARAM_READ_REG	0x85
-#define FT_READ_ID_REG		0x90
-#define FT_FW_START_REG		0xbf
-#define FT_REG_ECC		0xcc
-#define FT_RST_CMD_REG1		0xfc
-
-/* Undocumented firmware update values */
-#define FT_UPGRADE_AA		0xAA
-#define FT_UPGRADE_55		0x55
-#define FT_UPGRADE_LOOP		30
-#define FT_FW_MIN_SIZE		8
-#define FT_FW_MAX_SIZE		64*1024
-#define FT_FW_NAME_MAX_LEN	50
-#define FT_MAX_TRIES		5
-#define FT_RETRY_DLY		20
-#define FT_MAX_WR_BUF		10
-#define FT_MAX_RD_BUF		2
-#define FT_FW_PKT_LEN		128
-#define FT_FW_PKT_READ_LEN	256
-#define FT_FW_PKT_META_LEN	6
-#define FT_FW_PKT_DLY_MS	20
-
-/* Chip ID that we consider correct */
-#define FT5x06_ID	0x55
-#define FT5x16_ID	0x0a
-#define FT5x26_ID	0x54
-
-/* Print macros */
-#define LOG(fmt, arg...) fprintf(stdout, "[%s]: " fmt "\n" , __func__ , ## arg)
-#define ERR(fmt, arg...) fprintf(stderr, "[%s]: " fmt "\n" , __func__ , ## arg)
-#ifndef DEBUG
-#define DBG(fmt, arg...) {}
-#else
-#define DBG(fmt, arg...) fprintf(stdout, "[%s]: " fmt "\n" , __func__ , ## arg)
-#endif
-
-static inline void msleep(int delay) { usleep(delay*1000); }
-
-struct ft5x06_ts {
-	int fd;
-	uint8_t addr;
-	uint8_t chip_id;
-	uint8_t	fw_ver;
-};
-
-struct ft5x06_fw_update_info {
-	uint8_t chip_id;
-	char fts_name[20];
-	uint8_t tpd_max_points;
-	uint8_t auto_clb;
-	uint16_t delay_aa;		/*delay of write FT_UPGRADE_AA */
-	uint16_t delay_55;		/*delay of write FT_UPGRADE_55 */
-	uint8_t upgrade_id_1;		/*upgrade id 1 */
-	uint8_t upgrade_id_2;		/*upgrade id 2 */
-	uint16_t delay_readid;		/*delay of read id */
-	uint16_t delay_erase_flash;	/*delay of erase flash*/
-	uint32_t flash_offset;
-};
+#include "ft5x06.h"
 
 /*
  * Update information taken from FocalTech (bloated) driver:
  * https://github.com/focaltech-systems/drivers-input-touchscreen-FTS_driver
  */
 struct ft5x06_fw_update_info ft5x06_fwu_info[] = {
-	{FT5x06_ID, "ft5x06", 5, 1, 50,  30, 0x79, 0x03, 10, 2000, 0x0000},
-	{FT5x16_ID, "ft5x16", 5, 1, 50,  30, 0x79, 0x07, 10, 1500, 0x0000},
-	{FT5x26_ID, "ft5x26", 5, 0,  4, 250, 0x54, 0x2c, 10, 3000, 0x1800},
+	{FT5x06_ID, "ft5x06", 5, 1, 50,  30, 0x79, 0x03, 10, 2000, 0x0000,
+	 2, FT_FW_MAX_SIZE},
+	{FT5x16_ID, "ft5x16", 5, 1, 50,  30, 0x79, 0x07, 10, 1500, 0x0000,
+	 2, FT_FW_MAX_SIZE},
+	{FT5x26_ID, "ft5x26", 5, 0,  4, 250, 0x54, 0x2c, 10, 3000, 0x1800,
+	 2, FT_FW_MAX_SIZE},
 };
 
-static int ft5x06_i2c_read(int fd, int addr, uint8_t *wrbuf, uint16_t wrlen,
-			   uint8_t *rdbuf, uint16_t rdlen)
+static const struct ft5x06_transport *transport;
+
+/* Replaces the i2c-dev ioctl for every transaction (NULL to restore it) */
+void ft5x06_set_transport(const struct ft5x06_transport *t)
+{
+	transport = t;
+}
+
+const struct ft5x06_transport *ft5x06_get_transport(void)
+{
+	return transport;
+}
+
+int ft5x06_transport_xfer(const struct ft5x06_transport *t, int fd,
+			  struct i2c_rdwr_ioctl_data *data)
+{
+	if (t)
+		return t->xfer(t->priv, fd, data);
+
+	return ioctl(fd, I2C_RDWR, data);
+}
+
+int ft5x06_i2c_read(int fd, int addr, uint8_t *wrbuf, uint16_t wrlen,
+		    uint8_t *rdbuf, uint16_t rdlen)
 {
 	struct i2c_rdwr_ioctl_data data;
+	uint64_t t = ft5x06_trace_start();
 	int ret;
 
+	ft5x06_bus_lock(fd);
 	if (wrlen > 0) {
 		struct i2c_msg msgs[] = {
 			{ addr, 0, wrlen, wrbuf },
@@ -133,15 +71,17 @@ static int ft5x06_i2c_read(int fd, int addr, uint8_t *wrbuf, uint16_t wrlen,
 		};
 		data.msgs  = msgs;
 		data.nmsgs = ARRAY_SIZE(msgs);
-		ret = ioctl(fd, I2C_RDWR, &data);
+		ret = ft5x06_transport_xfer(transport, fd, &data);
 	} else {
 		struct i2c_msg msgs[] = {
 			{ addr, I2C_M_RD, rdlen, rdbuf },
 		};
 		data.msgs  = msgs;
 		data.nmsgs = ARRAY_SIZE(msgs);
-		ret = ioctl(fd, I2C_RDWR, &data);
+		ret = ft5x06_transport_xfer(transport, fd, &data);
 	}
+	ft5x06_bus_unlock(fd);
+	ft5x06_trace_span("i2c read", t, "\"wr\":%u,\"rd\":%u", wrlen, rdlen);
 
 	if (ret < 0)
 		ERR("Error %d", ret);
@@ -149,8 +89,9 @@ static int ft5x06_i2c_read(int fd, int addr, uint8_t *wrbuf, uint16_t wrlen,
 	return ret;
 }
 
-static int ft5x06_i2c_write(int fd, int addr, uint8_t *buf, uint16_t len)
+int ft5x06_i2c_write(int fd, int addr, uint8_t *buf, uint16_t len)
 {
+	uint64_t t = ft5x06_trace_start();
 	int ret;
 	struct i2c_rdwr_ioctl_data data;
 	struct i2c_msg msgs[] = {
@@ -160,14 +101,17 @@ static int ft5x06_i2c_write(int fd, int addr, uint8_t *buf, uint16_t len)
 	data.msgs  = msgs;
 	data.nmsgs = ARRAY_SIZE(msgs);
 
-	ret = ioctl(fd, I2C_RDWR, &data);
+	ft5x06_bus_lock(fd);
+	ret = ft5x06_transport_xfer(transport, fd, &data);
+	ft5x06_bus_unlock(fd);
+	ft5x06_trace_span("i2c write", t, "\"len\":%u", len);
 	if (ret < 0)
 		ERR("Error %d", ret);
 
 	return ret;
 }
 
-static void ft5x06_write_reg(int fd, int addr, uint8_t regnum, uint8_t value)
+void ft5x06_write_reg(int fd, int addr, uint8_t regnum, uint8_t value)
 {
 	uint8_t regnval[] = {
 		regnum,
@@ -177,7 +121,28 @@ static void ft5x06_write_reg(int fd, int addr, uint8_t regnum, uint8_t value)
 	ft5x06_i2c_write(fd, addr, regnval, ARRAY_SIZE(regnval));
 }
 
-static char *ft5x06_get_name(unsigned chip_id)
+int ft5x06_read_regs(int fd, int addr, uint8_t regnum, uint8_t *buf,
+		     uint16_t len)
+{
+	return ft5x06_i2c_read(fd, addr, &regnum, 1, buf, len);
+}
+
+/* Burst write of consecutive registers, starting at regnum */
+int ft5x06_write_regs(int fd, int addr, uint8_t regnum, const uint8_t *buf,
+		      uint16_t len)
+{
+	uint8_t packet_buf[FT5x06_MAX_REG_OFFSET + 2];
+
+	if (len > FT5x06_MAX_REG_OFFSET + 1)
+		return -EINVAL;
+
+	packet_buf[0] = regnum;
+	memcpy(&packet_buf[1], buf, len);
+
+	return ft5x06_i2c_write(fd, addr, packet_buf, len + 1);
+}
+
+char *ft5x06_get_name(unsigned chip_id)
 {
 	int i;
 
@@ -188,7 +153,7 @@ static char *ft5x06_get_name(unsigned chip_id)
 	return NULL;
 }
 
-static struct ft5x06_fw_update_info *ft5x06_get_info(unsigned chip_id)
+struct ft5x06_fw_update_info *ft5x06_get_info(unsigned chip_id)
 {
 	int i;
 
@@ -199,6 +164,34 @@ static struct ft5x06_fw_update_info *ft5x06_get_info(unsigned chip_id)
 	return NULL;
 }
 
+/* Flash size in bytes replacing the family one, 0 to keep it */
+static uint32_t flash_size_override;
+
+void ft5x06_set_flash_size(uint32_t size)
+{
+	flash_size_override = size;
+}
+
+/*
+ * Copy of the family parameters for a flash user (session, emulator),
+ * with the flash size override applied. The table itself is left alone.
+ */
+int ft5x06_get_flash_info(unsigned chip_id, struct ft5x06_fw_update_info *info)
+{
+	struct ft5x06_fw_update_info *family = ft5x06_get_info(chip_id);
+
+	if (family == NULL)
+		return -ENODEV;
+
+	*info = *family;
+	if (flash_size_override) {
+		info->fw_max_size = flash_size_override;
+		info->addr_width = (info->fw_max_size > 0x10000) ? 3 : 2;
+	}
+
+	return 0;
+}
+
 /* Undocumented function but necessary for ft5426 */
 static void ft5x26_hid_to_i2c(int fd, int addr)
 {
@@ -222,8 +215,10 @@ static int ft5x06_read_id(int fd, int addr, int chip_id)
 	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
 	uint8_t reg_val[2] = {0};
 	uint8_t packet_buf[4];
+	uint64_t t = ft5x06_trace_start();
 
 	msleep(info->delay_readid);
+	ft5x06_trace_span("read_id sleep", t, NULL);
 	packet_buf[0] = FT_READ_ID_REG;
 	packet_buf[1] = packet_buf[2] = packet_buf[3] = 0x00;
 
@@ -240,20 +235,27 @@ static int ft5x06_read_id(int fd, int addr, int chip_id)
 static void ft5x06_reset_ctpm(int fd, int addr, int chip_id)
 {
 	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	uint64_t t;
 
 	ft5x06_write_reg(fd, addr, FT_RST_CMD_REG1, FT_UPGRADE_AA);
+	t = ft5x06_trace_start();
 	msleep(info->delay_aa);
+	ft5x06_trace_span("reset 0xaa sleep", t, NULL);
 	ft5x06_write_reg(fd, addr, FT_RST_CMD_REG1, FT_UPGRADE_55);
+	t = ft5x06_trace_start();
 	msleep(info->delay_55);
+	ft5x06_trace_span("reset 0x55 sleep", t, NULL);
 }
 
 static void ft5x06_reset_fw(int fd, int addr)
 {
 	uint8_t packet_buf = FT_REG_RESET_FW;
+	uint64_t t = ft5x06_trace_start();
 
 	ft5x06_i2c_write(fd, addr, &packet_buf, 1);
 
 	msleep(100);
+	ft5x06_trace_span("reset_fw", t, NULL);
 }
 
 static int ft5x06_init_upgrade(int fd, int addr, int chip_id)
@@ -262,6 +264,8 @@ static int ft5x06_init_upgrade(int fd, int addr, int chip_id)
 	uint8_t packet_buf[4];
 
 	for (i = 0; i < FT_UPGRADE_LOOP; i++) {
+		uint64_t t = ft5x06_trace_start();
+
 		/* Step 1: Reset CTPM */
 		LOG("Reset CTPM");
 		ft5x06_reset_ctpm(fd, addr, chip_id);
@@ -275,12 +279,16 @@ static int ft5x06_init_upgrade(int fd, int addr, int chip_id)
 		ret = ft5x06_i2c_write(fd, addr, packet_buf, 2);
 		if (ret < 0) {
 			ERR("failed to enter upgrade mode (%d)", ret);
+			ft5x06_trace_span("init_upgrade", t, "\"attempt\":%d",
+					  i + 1);
 			continue;
 		}
 
 		/* Step 3: Check READ-ID */
 		LOG("Check READ-ID");
-		if (ft5x06_read_id(fd, addr, chip_id) == 0)
+		ret = ft5x06_read_id(fd, addr, chip_id);
+		ft5x06_trace_span("init_upgrade", t, "\"attempt\":%d", i + 1);
+		if (ret == 0)
 			break;
 	}
 
@@ -290,22 +298,30 @@ static int ft5x06_init_upgrade(int fd, int addr, int chip_id)
 	return 0;
 }
 
-static void ft5x06_fw_send_packet(int fd, int addr, uint8_t command,
-				  uint32_t offset, uint32_t length,
-				  const uint8_t *data, uint8_t *ecc)
+/* Flash offsets always take 3 bytes, the first one unused below 64 KiB */
+void ft5x06_fw_put_offset(uint8_t *buf, uint32_t offset, int addr_width)
+{
+	buf[0] = (addr_width > 2) ? (uint8_t) (offset >> 16) : 0x00;
+	buf[1] = (uint8_t) (offset >> 8);
+	buf[2] = (uint8_t) offset;
+}
+
+static void ft5x06_fw_send_packet(int fd, int addr, int addr_width,
+				  uint8_t command, uint32_t offset,
+				  uint32_t length, const uint8_t *data,
+				  uint8_t *ecc)
 {
 	uint8_t packet_buf[FT_FW_PKT_LEN + 6];
+	uint64_t t = ft5x06_trace_start();
 	int i;
 
 	LOG("Write pkt [%x] @%x - len %d", command, offset, length);
 	packet_buf[0] = command;
-	packet_buf[1] = 0x00;
-	packet_buf[2] = (uint8_t) (offset >> 8);
-	packet_buf[3] = (uint8_t) offset;
+	ft5x06_fw_put_offset(&packet_buf[1], offset, addr_width);
 	packet_buf[4] = (uint8_t) (length >> 8);
 	packet_buf[5] = (uint8_t) length;
 	for (i = 0; i < length; i++) {
-		packet_buf[6 + i] = data[offset + i];
+		packet_buf[6 + i] = data[i];
 		*ecc ^= packet_buf[6 + i];
 	}
 
@@ -316,40 +332,107 @@ static void ft5x06_fw_send_packet(int fd, int addr, uint8_t command,
 	for (i = 0; i < 5; i++) {
 		uint8_t reg_val[2] = {0};
 		uint32_t pkt_num = offset / FT_FW_PKT_LEN;
+		uint64_t tp = ft5x06_trace_start();
 
 		msleep(5);
 		packet_buf[0] = FT_FLASH_STATUS;
 		ft5x06_i2c_read(fd, addr, packet_buf, 1, reg_val, 2);
+		ft5x06_trace_span("status poll", tp, "\"status\":%u",
+				  (reg_val[0] << 8) | reg_val[1]);
 		if ((pkt_num + 0x1000) == (((reg_val[0]) << 8) | reg_val[1]))
 			break;
 	}
 #endif
+	ft5x06_trace_span("write packet", t, "\"offset\":%u,\"len\":%u",
+			  offset, length);
 }
 
-static int ft5x06_fw_receive_packet(int fd, int addr, uint8_t command,
-				    uint32_t offset, uint32_t length,
-				    uint8_t *data)
+static int ft5x06_fw_receive_packet(int fd, int addr, int addr_width,
+				    uint8_t command, uint32_t offset,
+				    uint32_t length, uint8_t *data)
 {
 	uint8_t packet_buf[4];
+	uint64_t t = ft5x06_trace_start();
+	int ret;
 
 	LOG("Read pkt [%x] @%x - len %d", command, offset, length);
 	packet_buf[0] = command;
-	packet_buf[1] = 0x00;
-	packet_buf[2] = (uint8_t) (offset >> 8);
-	packet_buf[3] = (uint8_t) offset;
+	ft5x06_fw_put_offset(&packet_buf[1], offset, addr_width);
 
-	return ft5x06_i2c_read(fd, addr, packet_buf, ARRAY_SIZE(packet_buf),
-			       data, length);
+	ret = ft5x06_i2c_read(fd, addr, packet_buf, ARRAY_SIZE(packet_buf),
+			      data, length);
+	ft5x06_trace_span("read packet", t, "\"offset\":%u,\"len\":%u",
+			  offset, length);
+
+	return ret;
 }
 
-static int ft5x06_fw_read(int fd, int addr, int chip_id, int outfd)
+/*
+ * Bootloader session: upgrade mode is entered once, any number of flash
+ * operations are run and the firmware is reset once at the end. The bus
+ * stays locked for the whole session.
+ */
+int ft5x06_session_begin(struct ft5x06_session *s, int fd, int addr,
+			 int chip_id)
+{
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	ret = ft5x06_get_flash_info(chip_id, &s->family);
+	if (ret < 0)
+		return ret;
+	s->info = &s->family;
+	s->fd = fd;
+	s->addr = addr;
+	s->chip_id = chip_id;
+	s->trace_ns = ft5x06_trace_start();
+
+	ft5x06_bus_lock(fd);
+	ret = ft5x06_init_upgrade(fd, addr, chip_id);
+	if (ret < 0) {
+		ft5x06_bus_unlock(fd);
+		return ret;
+	}
+	s->active = true;
+
+	return 0;
+}
+
+void ft5x06_session_end(struct ft5x06_session *s)
+{
+	if (!s->active)
+		return;
+
+	LOG("Reset the new FW");
+	ft5x06_reset_fw(s->fd, s->addr);
+	ft5x06_bus_unlock(s->fd);
+	s->active = false;
+	ft5x06_trace_span("session", s->trace_ns, NULL);
+}
+
+/* Refuses ranges the family can't address or doesn't have */
+static int ft5x06_session_check(struct ft5x06_session *s, uint32_t offset,
+				uint32_t length)
+{
+	if (offset + length > s->info->fw_max_size ||
+	    (s->info->addr_width < 3 && offset + length > 0x10000)) {
+		ERR("%u bytes @%x out of %s flash (%u bytes)", length, offset,
+		    s->info->fts_name, s->info->fw_max_size);
+		return -EFBIG;
+	}
+
+	return 0;
+}
+
+/* A size of 0 reads the whole flash of the family */
+int ft5x06_session_dump(struct ft5x06_session *s, int outfd, uint32_t size)
 {
 	int i, ret;
-	uint32_t size = FT_FW_MAX_SIZE;
-	uint8_t packet_buf[4];
 	uint8_t data[FT_FW_PKT_READ_LEN];
 
-	ret = ft5x06_init_upgrade(fd, addr, chip_id);
+	if (!size)
+		size = s->info->fw_max_size;
+	ret = ft5x06_session_check(s, 0, size);
 	if (ret < 0)
 		return ret;
 
@@ -361,66 +444,192 @@ static int ft5x06_fw_read(int fd, int addr, int chip_id, int outfd)
 			length = (size - i);
 
 		msleep(10);
-		ret = ft5x06_fw_receive_packet(fd, addr, FT_FW_READ_REG, i,
-					       length, data);
+		ret = ft5x06_fw_receive_packet(s->fd, s->addr,
+					       s->info->addr_width,
+					       FT_FW_READ_REG, i, length,
+					       data);
 		if (ret < 0)
 			return ret;
-		write(outfd, data, FT_FW_PKT_READ_LEN);
+		if (write(outfd, data, length) != length)
+			return -errno;
 	}
 
-	LOG("Reset the new FW");
-	packet_buf[0] = FT_REG_RESET_FW;
-	ft5x06_i2c_write(fd, addr, packet_buf, 1);
-	msleep(100);
-
 	return 0;
 }
 
-static int ft5x06_fw_upgrade(int fd, int addr, int chip_id,
-			     const uint8_t *data, uint32_t data_len)
+/* The bootloader reports the end of an erase in the flash status */
+bool ft5x06_erase_done(int fd, int addr)
 {
-	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
-	int i, ret;
-	uint8_t reg_val[4] = {0};
-	uint8_t packet_buf[6];
-	uint8_t ecc = 0;
+	uint8_t reg_val[2] = {0};
+	uint8_t packet_buf = FT_FLASH_STATUS;
 
-	if (info == NULL)
-		return -ENODEV;
+	if (ft5x06_i2c_read(fd, addr, &packet_buf, 1, reg_val, 2) < 0)
+		return false;
 
-	ret = ft5x06_init_upgrade(fd, addr, chip_id);
-	if (ret < 0)
-		return ret;
+	return ((reg_val[0] << 8) | reg_val[1]) == FT_FLASH_ERASE_DONE;
+}
+
+/*
+ * Polls for the end of the erase with growing intervals, delay_erase_flash
+ * is only the upper bound (and what parts not reporting it wait).
+ */
+int ft5x06_session_erase(struct ft5x06_session *s)
+{
+	uint8_t packet_buf[1];
+	uint64_t start, limit, t;
+	int interval = FT_ERASE_POLL_MIN_MS, polls = 0;
+	bool done = false;
 
 	LOG("Erase current app");
 	packet_buf[0] = FT_ERASE_APP_REG;
-	ft5x06_i2c_write(fd, addr, packet_buf, 1);
-	if (chip_id != FT5x26_ID) {
+	ft5x06_i2c_write(s->fd, s->addr, packet_buf, 1);
+	if (s->chip_id != FT5x26_ID) {
 		packet_buf[0] = FT_ERASE_PANEL_REG;
-		ft5x06_i2c_write(fd, addr, packet_buf, 1);
+		ft5x06_i2c_write(s->fd, s->addr, packet_buf, 1);
+	}
+	t = ft5x06_trace_start();
+	start = ft5x06_now_ns();
+	limit = start + s->info->delay_erase_flash * 1000000ull;
+	while (!done) {
+		uint64_t now = ft5x06_now_ns();
+
+		if (now >= limit)
+			break;
+		if (now + interval * 1000000ull > limit)
+			usleep((limit - now) / 1000);
+		else
+			msleep(interval);
+		interval = interval * 3 / 2;
+		if (interval > FT_ERASE_POLL_MAX_MS)
+			interval = FT_ERASE_POLL_MAX_MS;
+
+		done = ft5x06_erase_done(s->fd, s->addr);
+		polls++;
 	}
-	msleep(info->delay_erase_flash);
+	ft5x06_trace_span("erase wait", t, "\"polls\":%d", polls);
+	if (done)
+		LOG("%s erase done in %.0f ms (limit %u ms, %d polls)",
+		    s->info->fts_name, (ft5x06_now_ns() - start) / 1e6,
+		    s->info->delay_erase_flash, polls);
+	else
+		LOG("%s erase not reported, waited %u ms", s->info->fts_name,
+		    s->info->delay_erase_flash);
+	s->ecc = 0;
+
+	return 0;
+}
+
+/* Writes data at a flash offset, the ECC accumulates until verified */
+static void ft5x06_session_write(struct ft5x06_session *s, uint32_t offset,
+				 const uint8_t *data, uint32_t data_len)
+{
+	int i;
+
+	for (i = 0; i < data_len; i += FT_FW_PKT_LEN) {
+		uint32_t length = FT_FW_PKT_LEN;
+
+		if ((data_len - i) < FT_FW_PKT_LEN)
+			length = (data_len - i);
+
+		ft5x06_fw_send_packet(s->fd, s->addr, s->info->addr_width,
+				      FT_FW_START_REG, offset + i, length,
+				      data + i, &s->ecc);
+	}
+}
+
+/*
+ * Same as above, streaming from a file through a fixed size buffer so
+ * that memory use doesn't depend on the image size.
+ */
+static int ft5x06_session_write_fd(struct ft5x06_session *s, uint32_t offset,
+				   int fd, uint32_t data_len)
+{
+	uint8_t chunk[FT_FW_STREAM_CHUNK];
+	uint32_t done = 0;
+
+	while (done < data_len) {
+		uint32_t length = data_len - done;
+		ssize_t ret;
+
+		if (length > sizeof(chunk))
+			length = sizeof(chunk);
+
+		ret = pread(fd, chunk, length, done);
+		if (ret != length)
+			return ret < 0 ? -errno : -EIO;
+
+		ft5x06_session_write(s, offset + done, chunk, length);
+		done += length;
+	}
+
+	return 0;
+}
+
+static void ft5x06_session_set_len(struct ft5x06_session *s,
+				   uint32_t data_len)
+{
+	uint8_t packet_buf[4];
 
 	/* Prepare the system to receive a new firmware? */
 	packet_buf[0] = 0xB0;
 	packet_buf[1] = (uint8_t)((data_len >> 16) & 0xFF);
 	packet_buf[2] = (uint8_t)((data_len >> 8) & 0xFF);
 	packet_buf[3] = (uint8_t)(data_len & 0xFF);
-	ft5x06_i2c_write(fd, addr, packet_buf, 4);
+	ft5x06_i2c_write(s->fd, s->addr, packet_buf, 4);
+}
+
+int ft5x06_session_program(struct ft5x06_session *s, const uint8_t *data,
+			   uint32_t data_len)
+{
+	int ret = ft5x06_session_check(s, 0, data_len);
+
+	if (ret < 0)
+		return ret;
+	ft5x06_session_set_len(s, data_len);
 
 	LOG("Write firmware to CTPM flash");
-	for (i = 0; i < data_len; i += FT_FW_PKT_LEN) {
-		uint32_t length = FT_FW_PKT_LEN;
+	ft5x06_session_write(s, 0, data, data_len);
+	msleep(50);
 
-		if ((data_len - i) < FT_FW_PKT_LEN)
-			length = (data_len - i);
+	return 0;
+}
 
-		ft5x06_fw_send_packet(fd, addr, FT_FW_START_REG, i,
-				      length, data, &ecc);
-	}
+int ft5x06_session_program_fd(struct ft5x06_session *s, int fd,
+			      uint32_t data_len)
+{
+	int ret = ft5x06_session_check(s, 0, data_len);
+
+	if (ret < 0)
+		return ret;
+	ft5x06_session_set_len(s, data_len);
 
+	LOG("Write firmware to CTPM flash");
+	ret = ft5x06_session_write_fd(s, 0, fd, data_len);
 	msleep(50);
 
+	return ret;
+}
+
+int ft5x06_session_param_fd(struct ft5x06_session *s, uint32_t offset,
+			    int fd, uint32_t data_len)
+{
+	int ret = ft5x06_session_check(s, offset, data_len);
+
+	if (ret < 0)
+		return ret;
+
+	LOG("Write %u bytes of parameters @%x", data_len, offset);
+	ret = ft5x06_session_write_fd(s, offset, fd, data_len);
+	msleep(50);
+
+	return ret;
+}
+
+int ft5x06_session_verify(struct ft5x06_session *s)
+{
+	uint8_t reg_val[4] = {0};
+	uint8_t packet_buf[6];
+
 	LOG("Verify checksum");
 #if 0 /* FT5426 checksum method doesn't seem to work */
 	packet_buf[0] = 0x64;
@@ -446,18 +655,50 @@ static int ft5x06_fw_upgrade(int fd, int addr, int chip_id,
 #else
 	packet_buf[0] = FT_REG_ECC;
 #endif
-	ft5x06_i2c_read(fd, addr, packet_buf, 1, reg_val, 1);
-	if (reg_val[0] != ecc) {
-		ERR("ECC error %02x vs. %02x", reg_val[0], ecc);
+	ft5x06_i2c_read(s->fd, s->addr, packet_buf, 1, reg_val, 1);
+	if (reg_val[0] != s->ecc) {
+		ERR("ECC error %02x vs. %02x", reg_val[0], s->ecc);
 		return -EIO;
 	}
 
-	LOG("Reset the new FW");
-	ft5x06_reset_fw(fd, addr);
-
 	return 0;
 }
 
+int ft5x06_fw_read(int fd, int addr, int chip_id, int outfd)
+{
+	struct ft5x06_session s;
+	int ret;
+
+	ret = ft5x06_session_begin(&s, fd, addr, chip_id);
+	if (ret < 0)
+		return ret;
+
+	ret = ft5x06_session_dump(&s, outfd, 0);
+	ft5x06_session_end(&s);
+
+	return ret;
+}
+
+int ft5x06_fw_upgrade(int fd, int addr, int chip_id,
+		      const uint8_t *data, uint32_t data_len)
+{
+	struct ft5x06_session s;
+	int ret;
+
+	ret = ft5x06_session_begin(&s, fd, addr, chip_id);
+	if (ret < 0)
+		return ret;
+
+	ret = ft5x06_session_erase(&s);
+	if (ret == 0)
+		ret = ft5x06_session_program(&s, data, data_len);
+	if (ret == 0)
+		ret = ft5x06_session_verify(&s);
+	ft5x06_session_end(&s);
+
+	return ret;
+}
+
 static void show_help(const char *name)
 {
 	printf
@@ -470,6 +711,69 @@ static void show_help(const char *name)
 	     "Default is read from controller.\n"
 	     "\t-i, --input\n\t\tInput firmware file to flash.\n"
 	     "\t-o, --output\n\t\tOutput firmware file read from FT5x06.\n"
+	     "\t--job\n\t\tOperations run in one upgrade session, e.g. "
+	     "dump=old.bin,erase,program=new.bin,verify,param=<hex offset>:"
+	     "file.\n"
+	     "\t--flash-size\n\t\tOverride the flash size of the family (KiB), "
+	     "for parts not in the table yet.\n"
+	     "\t--bench-flash\n\t\tMeasure program/verify/dump throughput "
+	     "on 64 to 256 KiB images (needs --emulate).\n"
+	     "\t--bench-evdev\n\t\tCompare INT-to-data latency of the given "
+	     "evdev node against direct reads.\n"
+	     "\t--gpio\n\t\tINT line as <gpiochip>:<line>.\n"
+	     "\t--count\n\t\tNumber of frames to measure. Default is 1000.\n"
+	     "\t--cpu\n\t\tCPU to pin measurement loops on. Default is none.\n"
+	     "\t--emulate\n\t\tTalk to an emulated controller of the given "
+	     "chip ID (hex) instead of the bus.\n"
+	     "\t--emulate-taps\n\t\tHave the emulated controller report "
+	     "random taps.\n"
+	     "\t--fault\n\t\tInject transport faults, e.g. "
+	     "nak=0.01,short=0.01,delay=0.05,corrupt=0.01.\n"
+	     "\t--fault-bench\n\t\tMeasure flash retry overhead per fault "
+	     "type (needs --emulate).\n"
+	     "\t--track\n\t\tTrack contacts with stable IDs (INT driven if "
+	     "--gpio is given).\n"
+	     "\t--tune\n\t\tSearch touch thresholds and recommend the best "
+	     "profile.\n"
+	     "\t--tune-apply\n\t\tSame as --tune but keep the best profile.\n"
+	     "\t--tune-window\n\t\tIdle measurement per candidate (ms). "
+	     "Default is 1000.\n"
+	     "\t--capture\n\t\tRecord raw data frames to the given file, "
+	     "--count 0 records until Ctrl-C.\n"
+	     "\t--capture-info\n\t\tSummarize a capture file, no device "
+	     "needed.\n"
+	     "\t--frame\n\t\tWith --capture-info, print that frame.\n"
+	     "\t--selftest\n\t\tRun the open/short/noise/uniformity checks "
+	     "against the given limits file.\n"
+	     "\t--poll\n\t\tPoll touch reports for the given number of seconds, "
+	     "for boards without INT line.\n"
+	     "\t--poll-idle\n\t\tPolling period (ms) while nothing touches "
+	     "the panel. Default is 50.\n"
+	     "\t--trace\n\t\tAppend timed spans to the given Chrome trace "
+	     "(JSON) file.\n"
+	     "\t--ktrace\n\t\tSplit I2C transaction time into system call, "
+	     "adapter driver and wire using the kernel i2c tracepoints.\n"
+	     "\t--pm-pin\n\t\tKeep the I2C controller out of runtime suspend "
+	     "while running.\n"
+	     "\t--pm-bench\n\t\tCompare register read latency with the "
+	     "controller runtime suspended or pinned.\n"
+	     "\t--async\n\t\tRun -i/-o through the non-blocking API from a "
+	     "single poll loop.\n"
+	     "\t--batch\n\t\tRun the commands of the given file (- for stdin), "
+	     "one result line each.\n"
+	     "\t--merge\n\t\tMerge the touches of a second controller "
+	     "(<bus>:<addr>) into one uinput device.\n"
+	     "\t--merge-gpio\n\t\tINT line of the second controller.\n"
+	     "\t--merge-offset\n\t\tPosition <x>,<y> of the second "
+	     "controller in the merged space. Default is 0,0.\n"
+	     "\t--merge-seam\n\t\tDistance under which contacts of both "
+	     "controllers are the same finger. Default is 24.\n"
+	     "\t--vblank\n\t\tSchedule touch reads on the vblanks of the "
+	     "given DRM card (<card>[:<crtc>]), or timer.\n"
+	     "\t--vblank-margin\n\t\tTime (us) the data should be ready "
+	     "before each vblank. Default is 1000.\n"
+	     "\t--vblank-hz\n\t\tRefresh rate of the timer fallback. "
+	     "Default is 60.\n"
 	     "\t-h, --help\n\t\tShow this help and exit.\n", name);
 	return;
 }
@@ -477,7 +781,17 @@ static void show_help(const char *name)
 int main(int argc, const char *argv[])
 {
 	const char *input = NULL, *output = NULL;
+	const char *evdev = NULL, *gpio = NULL, *faults = NULL;
+	const char *capture = NULL, *capture_info = NULL;
+	const char *selftest = NULL, *trace = NULL, *batch = NULL;
+	const char *merge = NULL, *merge_gpio = NULL, *merge_offset = NULL;
+	const char *vblank = NULL;
+	double fault_rates[FT_FAULT_TYPES] = { 0 };
+	struct ft5x06_job jobs[FT_JOB_MAX];
+	char *job = NULL;
+	int njobs = 0;
 	char dev[16];
+	struct stat sb;
 	uint8_t *buffer;
 	uint8_t wbuf, rbuf;
 	int fd, ret;
@@ -485,6 +799,27 @@ int main(int argc, const char *argv[])
 	int bus = 2;
 	int addr = 0x38;
 	int chip_id = -1;
+	int count = 1000;
+	int cpu = -1;
+	int tune = 0;
+	int track = 0;
+	int tune_window = 1000;
+	int emulate = -1;
+	int fault_bench = 0;
+	int flash_size = 0;
+	int bench_flash = 0;
+	int frame = -1;
+	int status = 0;
+	int poll = 0;
+	int poll_idle = 50;
+	int emulate_taps = 0;
+	int ktrace = 0;
+	int pm_pin = 0;
+	int pm_bench = 0;
+	int async = 0;
+	int merge_seam = 24;
+	int vblank_margin = 1000;
+	int vblank_hz = 60;
 
 	/* Parse all parameters */
 	while (arg_count < argc) {
@@ -503,6 +838,74 @@ int main(int argc, const char *argv[])
 		} else if ((strcmp(argv[arg_count], "-o") == 0)
 			   || (strcmp(argv[arg_count], "--ouput") == 0)) {
 			output = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--job") == 0) {
+			job = strdup(argv[++arg_count]);
+		} else if (strcmp(argv[arg_count], "--flash-size") == 0) {
+			flash_size = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--bench-flash") == 0) {
+			bench_flash = 1;
+		} else if (strcmp(argv[arg_count], "--bench-evdev") == 0) {
+			evdev = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--gpio") == 0) {
+			gpio = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--count") == 0) {
+			count = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--cpu") == 0) {
+			cpu = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--emulate") == 0) {
+			emulate = strtol(argv[++arg_count], NULL, 16);
+		} else if (strcmp(argv[arg_count], "--emulate-taps") == 0) {
+			emulate_taps = 1;
+		} else if (strcmp(argv[arg_count], "--fault") == 0) {
+			faults = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--fault-bench") == 0) {
+			fault_bench = 1;
+		} else if (strcmp(argv[arg_count], "--track") == 0) {
+			track = 1;
+		} else if (strcmp(argv[arg_count], "--tune") == 0) {
+			tune = 1;
+		} else if (strcmp(argv[arg_count], "--tune-apply") == 0) {
+			tune = 2;
+		} else if (strcmp(argv[arg_count], "--tune-window") == 0) {
+			tune_window = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--capture") == 0) {
+			capture = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--capture-info") == 0) {
+			capture_info = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--selftest") == 0) {
+			selftest = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--poll") == 0) {
+			poll = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--poll-idle") == 0) {
+			poll_idle = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--trace") == 0) {
+			trace = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--ktrace") == 0) {
+			ktrace = 1;
+		} else if (strcmp(argv[arg_count], "--pm-pin") == 0) {
+			pm_pin = 1;
+		} else if (strcmp(argv[arg_count], "--pm-bench") == 0) {
+			pm_bench = 1;
+		} else if (strcmp(argv[arg_count], "--async") == 0) {
+			async = 1;
+		} else if (strcmp(argv[arg_count], "--batch") == 0) {
+			batch = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--merge") == 0) {
+			merge = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--merge-gpio") == 0) {
+			merge_gpio = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--merge-offset") == 0) {
+			merge_offset = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--merge-seam") == 0) {
+			merge_seam = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--vblank") == 0) {
+			vblank = argv[++arg_count];
+		} else if (strcmp(argv[arg_count], "--vblank-margin") == 0) {
+			vblank_margin = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--vblank-hz") == 0) {
+			vblank_hz = strtol(argv[++arg_count], NULL, 10);
+		} else if (strcmp(argv[arg_count], "--frame") == 0) {
+			frame = strtol(argv[++arg_count], NULL, 10);
 		} else {
 			show_help(argv[0]);
 			exit(1);
@@ -510,19 +913,67 @@ int main(int argc, const char *argv[])
 		arg_count++;
 	}
 
-	sprintf(dev, "/dev/i2c-%d", bus);
-	LOG("Opening %s", dev);
-	fd = open(dev, O_RDWR);
-	if (fd < 0) {
-		LOG("Couldn't open %s: %s", dev, strerror(errno));
-		return fd;
-	}
+	if (capture_info)
+		return ft5x06_capture_info(capture_info, frame) < 0 ? -1 : 0;
 
-	LOG("Setting addr to %#02x", addr);
-	ret = ioctl(fd, I2C_SLAVE_FORCE, addr);
-	if (ret != 0) {
-		LOG("Couldn't set slave addr: %s", strerror(errno));
+	if (faults && ft5x06_fault_parse(faults, fault_rates) < 0)
 		return -1;
+
+	if (flash_size > 0)
+		ft5x06_set_flash_size(flash_size * 1024);
+
+	if (emulate >= 0) {
+		fd = -1;
+		if (ft5x06_emul_init(emulate) < 0)
+			return -1;
+		ft5x06_emul_taps(emulate_taps);
+		if (ktrace)
+			ERR("--ktrace needs a real bus");
+	} else {
+		sprintf(dev, "/dev/i2c-%d", bus);
+		LOG("Opening %s", dev);
+		fd = open(dev, O_RDWR);
+		if (fd < 0) {
+			LOG("Couldn't open %s: %s", dev, strerror(errno));
+			return fd;
+		}
+
+		LOG("Setting addr to %#02x", addr);
+		ret = ioctl(fd, I2C_SLAVE_FORCE, addr);
+		if (ret != 0) {
+			LOG("Couldn't set slave addr: %s", strerror(errno));
+			return -1;
+		}
+
+		ft5x06_bus_lock_register(fd, bus);
+		if (ktrace)
+			ft5x06_ktrace_start(bus);
+		if (pm_pin)
+			ft5x06_pm_pin(bus);
+	}
+
+	if (faults && !fault_bench)
+		ft5x06_fault_init(fault_rates);
+
+	if (trace) {
+		char track[32];
+
+		if (emulate >= 0)
+			snprintf(track, sizeof(track), "emulator %#x", emulate);
+		else
+			snprintf(track, sizeof(track), "i2c-%d %#02x", bus, addr);
+		if (ft5x06_trace_open(trace, track) < 0)
+			return -1;
+	}
+
+	/* Commands detect (and cache) the chip ID themselves */
+	if (batch) {
+		ret = ft5x06_batch_run(batch, fd, emulate >= 0 ? -1 : bus,
+				       addr, chip_id);
+		if (ret < 0)
+			ERR("Batch failed to run (%d)", ret);
+		status = ret ? 1 : 0;
+		goto end;
 	}
 
 	/* If chip ID isn't forced, detect it */
@@ -541,6 +992,14 @@ int main(int argc, const char *argv[])
 	}
 	LOG("Chip ID: %#x (%s)", chip_id, ft5x06_get_name(chip_id));
 
+	if (flash_size > 0) {
+		struct ft5x06_fw_update_info info;
+
+		ft5x06_get_flash_info(chip_id, &info);
+		LOG("Flash size: %u bytes, %d-byte offsets", info.fw_max_size,
+		    info.addr_width);
+	}
+
 	/* Get current firmware version */
 	wbuf = ID_G_FIRMID;
 	ret = ft5x06_i2c_read(fd, addr, &wbuf, 1, &rbuf, 1);
@@ -550,50 +1009,162 @@ int main(int argc, const char *argv[])
 	}
 	LOG("Firmware version: %d.0.0", rbuf);
 
-	if (!input && !output) {
-		LOG("Nothing to do (read or write)");
+	if (evdev != NULL) {
+		if (gpio == NULL) {
+			ERR("--bench-evdev requires --gpio");
+			goto end;
+		}
+		ret = ft5x06_bench_evdev(fd, addr, chip_id, evdev, gpio,
+					 count, cpu);
+		if (ret < 0)
+			ERR("Benchmark failed (%d)", ret);
 		goto end;
 	}
 
-	/* First read the firmware if asked for */
-	if (output != NULL) {
-		int outfd = open(output, O_RDWR | O_CREAT);
-		if (outfd < 0) {
-			ERR("Unable to open file %s", output);
+	if (pm_bench) {
+		if (emulate >= 0) {
+			ERR("--pm-bench needs a real bus");
 			goto end;
 		}
-		ret = ft5x06_fw_read(fd, addr, chip_id, outfd);
+		ret = ft5x06_pm_bench(fd, addr, bus, count);
 		if (ret < 0)
-			ERR("Failed to read FW");
-		close(outfd);
+			ERR("Benchmark failed (%d)", ret);
+		goto end;
 	}
 
-	/* Then flash a new firmware if available */
-	if (input != NULL) {
-		struct stat sb;
-		int infd = open(input, O_RDONLY);
-		if (infd < 0) {
-			ERR("Unable to open file %s", input);
+	if (bench_flash) {
+		/* Erases and programs garbage, never on a real controller */
+		if (emulate < 0) {
+			ERR("--bench-flash requires --emulate");
 			goto end;
 		}
+		ret = ft5x06_bench_flash(fd, addr, chip_id);
+		if (ret < 0)
+			ERR("Benchmark failed (%d)", ret);
+		goto end;
+	}
 
-		LOG("Flashing %s", input);
-		fstat(infd, &sb);
-		LOG("FW length is %ld", sb.st_size);
-
-		buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, infd, 0);
-		if (buffer == MAP_FAILED) {
-			ERR("Couldn't map: %s", strerror(errno));
-			close(infd);
+	if (fault_bench) {
+		if (emulate < 0) {
+			ERR("--fault-bench requires --emulate");
 			goto end;
 		}
-		ret = ft5x06_fw_upgrade(fd, addr, chip_id, buffer, sb.st_size);
+		buffer = NULL;
+		sb.st_size = 0;
+		if (input != NULL) {
+			int infd = open(input, O_RDONLY);
+
+			if (infd < 0 || fstat(infd, &sb) < 0) {
+				ERR("Unable to open file %s", input);
+				goto end;
+			}
+			buffer = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+				      infd, 0);
+			close(infd);
+			if (buffer == MAP_FAILED) {
+				ERR("Couldn't map: %s", strerror(errno));
+				goto end;
+			}
+		}
+		ret = ft5x06_fault_bench(fd, addr, chip_id, buffer, sb.st_size,
+					 fault_rates);
+		if (buffer)
+			munmap(buffer, sb.st_size);
+		goto end;
+	}
+
+	if (track) {
+		ret = ft5x06_track_run(fd, addr, chip_id, gpio, count, cpu);
+		if (ret < 0)
+			ERR("Tracking failed (%d)", ret);
+		goto end;
+	}
+
+	if (merge) {
+		ret = ft5x06_merge_run(fd, addr, chip_id, gpio, merge,
+				       merge_gpio, merge_offset, merge_seam,
+				       count, cpu);
+		if (ret < 0)
+			ERR("Merging failed (%d)", ret);
+		goto end;
+	}
+
+	if (vblank) {
+		ret = ft5x06_vblank_run(fd, addr, chip_id, vblank, vblank_hz,
+					vblank_margin, count, cpu);
+		if (ret < 0)
+			ERR("Vblank sampling failed (%d)", ret);
+		goto end;
+	}
+
+	if (capture) {
+		ret = ft5x06_capture(fd, addr, capture, count);
 		if (ret < 0)
-			ERR("Failed to flash FW");
-		close(infd);
-		munmap(buffer, sb.st_size);
+			ERR("Capture failed (%d)", ret);
+		goto end;
 	}
+
+	if (selftest) {
+		ret = ft5x06_selftest(fd, addr, selftest);
+		if (ret < 0)
+			ERR("Self-test failed to run (%d)", ret);
+		status = ret ? 1 : 0;
+		goto end;
+	}
+
+	if (poll) {
+		ret = ft5x06_poll_run(fd, addr, chip_id, poll, poll_idle, cpu,
+				      emulate >= 0 ?
+				      ft5x06_emul_touch_down_ns : NULL);
+		if (ret < 0)
+			ERR("Polling failed (%d)", ret);
+		goto end;
+	}
+
+	if (tune) {
+		ret = ft5x06_tune(fd, addr, chip_id, tune_window, tune == 2);
+		if (ret < 0)
+			ERR("Tuning failed (%d)", ret);
+		goto end;
+	}
+
+	if (async) {
+		ret = ft5x06_async_run(fd, addr, chip_id, input, output);
+		if (ret < 0)
+			ERR("Failed to %s FW", input ? "flash" : "read");
+		goto end;
+	}
+
+	/* Dump and/or flash within a single bootloader session */
+	if (output != NULL)
+		jobs[njobs++] = (struct ft5x06_job){ FT_JOB_DUMP, output };
+	if (input != NULL) {
+		jobs[njobs++] = (struct ft5x06_job){ FT_JOB_ERASE };
+		jobs[njobs++] = (struct ft5x06_job){ FT_JOB_PROGRAM, input };
+		jobs[njobs++] = (struct ft5x06_job){ FT_JOB_VERIFY };
+	}
+	if (job != NULL) {
+		ret = ft5x06_job_parse(job, jobs + njobs, FT_JOB_MAX - njobs);
+		if (ret < 0)
+			goto end;
+		njobs += ret;
+	}
+
+	if (!njobs) {
+		LOG("Nothing to do (read or write)");
+		goto end;
+	}
+
+	ret = ft5x06_job_run(fd, addr, chip_id, jobs, njobs);
+	if (ret < 0)
+		ERR("Failed to %s FW", input ? "flash" : "read");
 end:
+	/* Job paths point into this copy, done with them */
+	free(job);
+	ft5x06_pm_restore();
+	ft5x06_bus_lock_report();
+	ft5x06_ktrace_report();
+	ft5x06_trace_close();
 	close(fd);
-	return 0;
+	return status;
 }
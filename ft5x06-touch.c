@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Touch report acquisition: INT line and work mode data registers
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ft5x06.h"
+
+int ft5x06_read_touch(int fd, int addr, struct ft5x06_touch_frame *frame,
+		      int max_points)
+{
+	uint8_t buf[1 + FT_MAX_POINTS * FT_TOUCH_POINT_LEN];
+	uint8_t reg = ID_G_TD_STATUS;
+	int i, ret;
+
+	if (max_points > FT_MAX_POINTS)
+		max_points = FT_MAX_POINTS;
+
+	/* Single burst: TD_STATUS followed by every point slot */
+	ret = ft5x06_i2c_read(fd, addr, &reg, 1, buf,
+			      1 + max_points * FT_TOUCH_POINT_LEN);
+	frame->ts = ft5x06_now_ns();
+	if (ret < 0)
+		return ret;
+
+	frame->count = buf[0] & 0x0f;
+	if (frame->count > max_points)
+		frame->count = 0;
+
+	for (i = 0; i < frame->count; i++) {
+		const uint8_t *p = &buf[1 + i * FT_TOUCH_POINT_LEN];
+
+		frame->p[i].event = p[0] >> 6;
+		frame->p[i].x = ((p[0] & 0x0f) << 8) | p[1];
+		frame->p[i].id = p[2] >> 4;
+		frame->p[i].y = ((p[2] & 0x0f) << 8) | p[3];
+		frame->p[i].weight = p[4];
+		frame->p[i].area = p[5] >> 4;
+	}
+
+	return frame->count;
+}
+
+/*
+ * Opens the INT line given as "<chip>:<line>", chip being either a
+ * number, a gpiochip name or a full path. Edge events are preferred; when
+ * the line is already used as IRQ by the kernel driver the event request
+ * fails, so fall back to a plain input handle that gets sampled.
+ */
+int ft5x06_gpio_open(const char *spec, bool *edge_events)
+{
+	struct gpioevent_request ereq;
+	struct gpiohandle_request hreq;
+	char path[64];
+	const char *sep = strchr(spec, ':');
+	int cfd, ret;
+
+	if (!sep) {
+		ERR("Invalid GPIO %s (expected <chip>:<line>)", spec);
+		return -EINVAL;
+	}
+
+	if (spec[0] == '/')
+		snprintf(path, sizeof(path), "%.*s", (int)(sep - spec), spec);
+	else if (strncmp(spec, "gpiochip", 8) == 0)
+		snprintf(path, sizeof(path), "/dev/%.*s", (int)(sep - spec),
+			 spec);
+	else
+		snprintf(path, sizeof(path), "/dev/gpiochip%.*s",
+			 (int)(sep - spec), spec);
+
+	cfd = open(path, O_RDONLY);
+	if (cfd < 0) {
+		ERR("Couldn't open %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	memset(&ereq, 0, sizeof(ereq));
+	ereq.lineoffset = strtoul(sep + 1, NULL, 10);
+	ereq.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	ereq.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+	strcpy(ereq.consumer_label, "ft5x06-tool");
+	ret = ioctl(cfd, GPIO_GET_LINEEVENT_IOCTL, &ereq);
+	if (ret == 0) {
+		close(cfd);
+		*edge_events = true;
+		return ereq.fd;
+	}
+	DBG("No edge events on %s (%s), sampling instead", spec,
+	    strerror(errno));
+
+	memset(&hreq, 0, sizeof(hreq));
+	hreq.lineoffsets[0] = ereq.lineoffset;
+	hreq.lines = 1;
+	hreq.flags = GPIOHANDLE_REQUEST_INPUT;
+	strcpy(hreq.consumer_label, "ft5x06-tool");
+	ret = ioctl(cfd, GPIO_GET_LINEHANDLE_IOCTL, &hreq);
+	close(cfd);
+	if (ret < 0) {
+		ERR("Couldn't request GPIO %s: %s", spec, strerror(errno));
+		return -errno;
+	}
+
+	*edge_events = false;
+	return hreq.fd;
+}
+
+/*
+ * Waits for the next falling edge of the (active low) INT line, at most
+ * timeout_ms: -ETIMEDOUT then. Kernels before 5.7 stamp line events with
+ * CLOCK_REALTIME, in which case the read completion time is used instead.
+ */
+int ft5x06_gpio_wait(int gfd, bool edge_events, int timeout_ms,
+		     uint64_t *edge_ns)
+{
+	uint64_t deadline = ft5x06_now_ns() + timeout_ms * 1000000ull;
+
+	if (edge_events) {
+		struct pollfd pfd = { gfd, POLLIN, 0 };
+		struct gpioevent_data ev;
+		uint64_t now;
+		int ret;
+
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ETIMEDOUT;
+		if (read(gfd, &ev, sizeof(ev)) != sizeof(ev))
+			return -errno;
+
+		now = ft5x06_now_ns();
+		if (ev.timestamp <= now && now - ev.timestamp < 1000000000ull)
+			*edge_ns = ev.timestamp;
+		else
+			*edge_ns = now;
+	} else {
+		struct gpiohandle_data data;
+		int prev = 0;
+
+		/* Busy sampling: wait for the line to be released first */
+		for (;;) {
+			if (ioctl(gfd, GPIOHANDLE_GET_LINE_VALUES_IOCTL,
+				  &data) < 0)
+				return -errno;
+			if (prev && !data.values[0])
+				break;
+			prev = data.values[0];
+			if (ft5x06_now_ns() >= deadline)
+				return -ETIMEDOUT;
+		}
+		*edge_ns = ft5x06_now_ns();
+	}
+
+	return 0;
+}
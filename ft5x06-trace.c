@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Timed spans exported in the Chrome trace event format (JSON array),
+ * viewable in chrome://tracing or ui.perfetto.dev
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "ft5x06.h"
+
+#define TRACE_BUF_SIZE		(64 * 1024)
+#define TRACE_EVENT_MAX		512
+
+bool ft5x06_tracing;
+
+/*
+ * Events are buffered and appended to the file in large writes. As the
+ * closing bracket of the array is optional, several processes (one per
+ * device) can append to the same file and end up on the same timeline,
+ * each on its own track.
+ */
+static struct {
+	int fd;
+	int pid;
+	pthread_mutex_t lock;
+	size_t len;
+	uint32_t dropped;		/* events too long for TRACE_EVENT_MAX */
+	char buf[TRACE_BUF_SIZE];
+} trace = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread long trace_tid;
+
+static void trace_flush(void)
+{
+	if (trace.len && write(trace.fd, trace.buf, trace.len) != trace.len)
+		ERR("Trace write failed: %s", strerror(errno));
+	trace.len = 0;
+}
+
+/*
+ * Events are never split across writes, other processes may append.
+ * A truncated event would leave broken JSON in the shared file, it is
+ * dropped instead.
+ */
+static void trace_put(const char *event, int len)
+{
+	if (len <= 0)
+		return;
+
+	pthread_mutex_lock(&trace.lock);
+	if (len >= TRACE_EVENT_MAX) {
+		trace.dropped++;
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+	if (trace.len + len > sizeof(trace.buf))
+		trace_flush();
+	memcpy(trace.buf + trace.len, event, len);
+	trace.len += len;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static long trace_gettid(void)
+{
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	return trace_tid;
+}
+
+int ft5x06_trace_open(const char *path, const char *track)
+{
+	struct stat sb;
+
+	trace.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			0644);
+	if (trace.fd < 0) {
+		ERR("Unable to open file %s", path);
+		return -errno;
+	}
+
+	/* Whoever comes first opens the array */
+	flock(trace.fd, LOCK_EX);
+	if (fstat(trace.fd, &sb) == 0 && sb.st_size == 0 &&
+	    write(trace.fd, "[\n", 2) != 2)
+		ERR("Trace write failed: %s", strerror(errno));
+	flock(trace.fd, LOCK_UN);
+
+	trace.pid = getpid();
+	ft5x06_tracing = true;
+	ft5x06_trace_meta("process_name", track);
+
+	return 0;
+}
+
+void ft5x06_trace_close(void)
+{
+	if (trace.fd < 0)
+		return;
+
+	ft5x06_tracing = false;
+	pthread_mutex_lock(&trace.lock);
+	trace_flush();
+	pthread_mutex_unlock(&trace.lock);
+	if (trace.dropped)
+		ERR("%u trace events over %d bytes dropped", trace.dropped,
+		    TRACE_EVENT_MAX);
+	close(trace.fd);
+	trace.fd = -1;
+}
+
+/* Names the process or calling thread track */
+void ft5x06_trace_meta(const char *type, const char *name)
+{
+	char event[TRACE_EVENT_MAX];
+
+	if (!ft5x06_tracing)
+		return;
+
+	trace_put(event, snprintf(event, sizeof(event),
+		  "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+		  "\"args\":{\"name\":\"%s\"}},\n", type, trace.pid,
+		  trace_gettid(), name));
+}
+
+/*
+ * Records a span from start_ns to now on the calling thread track.
+ * args, if not NULL, is a printf format for the content of the JSON
+ * args object, e.g. "\"offset\":%u".
+ */
+void ft5x06_trace_span(const char *name, uint64_t start_ns,
+		       const char *args, ...)
+{
+	char event[TRACE_EVENT_MAX];
+	uint64_t now;
+	va_list ap;
+	int len;
+
+	if (!ft5x06_tracing || !start_ns)
+		return;
+	now = ft5x06_now_ns();
+
+	len = snprintf(event, sizeof(event),
+		       "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+		       "\"ts\":%.3f,\"dur\":%.3f", name, trace.pid,
+		       trace_gettid(), start_ns / 1e3, (now - start_ns) / 1e3);
+	if (args && len < sizeof(event)) {
+		len += snprintf(event + len, sizeof(event) - len,
+				",\"args\":{");
+		va_start(ap, args);
+		if (len < sizeof(event))
+			len += vsnprintf(event + len, sizeof(event) - len,
+					 args, ap);
+		va_end(ap);
+		if (len < sizeof(event))
+			len += snprintf(event + len, sizeof(event) - len,
+					"}");
+	}
+	if (len < sizeof(event))
+		len += snprintf(event + len, sizeof(event) - len,
+				"},\n");
+
+	trace_put(event, len);
+}
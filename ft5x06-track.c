@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Multi-touch contact tracking with stable IDs
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+/* Squared distance (pixels) above which a contact can't continue a track */
+#define TRACK_GATE		(128.0f * 128.0f)
+#define TRACK_ALPHA		0.6f
+#define TRACK_BETA		0.2f
+#define TRACK_PERMS		120	/* FT_TRACK_MAX! */
+
+/*
+ * Every assignment of FT_TRACK_MAX contacts to FT_TRACK_MAX tracks, stored
+ * as indexes in the flattened cost matrix (track * FT_TRACK_MAX + contact)
+ * and column-major so that scoring all of them is a plain gather-add loop.
+ */
+static uint8_t track_perm_idx[FT_TRACK_MAX][TRACK_PERMS];
+static bool track_perm_ready;
+
+static void track_perm_init(void)
+{
+	uint8_t p[FT_TRACK_MAX];
+	int c[FT_TRACK_MAX] = { 0 };
+	int i = 0, k, n = 0;
+
+	for (k = 0; k < FT_TRACK_MAX; k++)
+		p[k] = k;
+
+	/* Heap's algorithm, iterative */
+	for (k = 0; k < FT_TRACK_MAX; k++)
+		track_perm_idx[k][n] = k * FT_TRACK_MAX + p[k];
+	n++;
+	while (i < FT_TRACK_MAX) {
+		if (c[i] < i) {
+			int j = (i % 2) ? c[i] : 0;
+			uint8_t tmp = p[j];
+
+			p[j] = p[i];
+			p[i] = tmp;
+			for (k = 0; k < FT_TRACK_MAX; k++)
+				track_perm_idx[k][n] = k * FT_TRACK_MAX + p[k];
+			n++;
+			c[i]++;
+			i = 0;
+		} else {
+			c[i] = 0;
+			i++;
+		}
+	}
+
+	track_perm_ready = true;
+}
+
+void ft5x06_tracker_init(struct ft5x06_tracker *tr, int max_points)
+{
+	if (!track_perm_ready)
+		track_perm_init();
+
+	memset(tr, 0, sizeof(*tr));
+	tr->max = (max_points > FT_TRACK_MAX) ? FT_TRACK_MAX : max_points;
+	tr->next_id = 1;
+}
+
+/*
+ * Exhaustive search over the permutation table. Unused rows and columns
+ * are padded with the gate cost so the search shape never changes, and
+ * the minimum is selected without branches.
+ */
+static int track_solve(const float *cost)
+{
+	float sum[TRACK_PERMS];
+	float best_cost;
+	int k, p, best = 0;
+
+	for (p = 0; p < TRACK_PERMS; p++)
+		sum[p] = cost[track_perm_idx[0][p]];
+	for (k = 1; k < FT_TRACK_MAX; k++)
+		for (p = 0; p < TRACK_PERMS; p++)
+			sum[p] += cost[track_perm_idx[k][p]];
+
+	best_cost = sum[0];
+	for (p = 1; p < TRACK_PERMS; p++) {
+		int better = sum[p] < best_cost;
+
+		best_cost = better ? sum[p] : best_cost;
+		best = better ? p : best;
+	}
+
+	return best;
+}
+
+int ft5x06_tracker_update(struct ft5x06_tracker *tr,
+			  const struct ft5x06_touch_frame *frame,
+			  struct ft5x06_tracked *out)
+{
+	float cost[FT_TRACK_MAX * FT_TRACK_MAX];
+	float px[FT_TRACK_MAX], py[FT_TRACK_MAX];
+	float cx[FT_TRACK_MAX], cy[FT_TRACK_MAX];
+	float dt = 0;
+	int count = frame->count;
+	int i, j, best, n = 0;
+
+	if (count > tr->max)
+		count = tr->max;
+	if (tr->last_ts)
+		dt = (frame->ts - tr->last_ts) / 1e6f;
+	tr->last_ts = frame->ts;
+	tr->frames++;
+
+	/* Predict every track, then build the padded cost matrix */
+	for (i = 0; i < FT_TRACK_MAX; i++) {
+		struct ft5x06_track *t = &tr->t[i];
+
+		px[i] = t->x + t->vx * dt;
+		py[i] = t->y + t->vy * dt;
+		cx[i] = (i < count) ? frame->p[i].x : 0;
+		cy[i] = (i < count) ? frame->p[i].y : 0;
+	}
+	for (i = 0; i < FT_TRACK_MAX; i++) {
+		for (j = 0; j < FT_TRACK_MAX; j++) {
+			float dx = px[i] - cx[j];
+			float dy = py[i] - cy[j];
+			float d = dx * dx + dy * dy;
+			bool live = tr->t[i].active;
+			bool present = j < count;
+
+			d = (d < TRACK_GATE) ? d : TRACK_GATE;
+			cost[i * FT_TRACK_MAX + j] = (live && present) ? d :
+				(live || present) ? TRACK_GATE : 0;
+		}
+	}
+
+	best = track_solve(cost);
+
+	for (i = 0; i < FT_TRACK_MAX; i++) {
+		struct ft5x06_track *t = &tr->t[i];
+		int c = track_perm_idx[i][best] - i * FT_TRACK_MAX;
+		const struct ft5x06_touch_point *pt = &frame->p[c];
+		float d = cost[i * FT_TRACK_MAX + c];
+
+		if (t->active && (c >= count || d >= TRACK_GATE)) {
+			t->active = false;
+			tr->ends++;
+		}
+
+		if (c >= count)
+			continue;
+
+		if (!t->active) {
+			/* Birth (or re-birth after a failed gate) */
+			memset(t, 0, sizeof(*t));
+			t->active = true;
+			t->id = tr->next_id++;
+			t->x = pt->x;
+			t->y = pt->y;
+			t->hw_id = pt->id;
+			tr->births++;
+		} else {
+			float rx = pt->x - px[i];
+			float ry = pt->y - py[i];
+
+			t->x = px[i] + TRACK_ALPHA * rx;
+			t->y = py[i] + TRACK_ALPHA * ry;
+			if (dt > 0) {
+				t->vx += TRACK_BETA * rx / dt;
+				t->vy += TRACK_BETA * ry / dt;
+			}
+			if (t->hw_id != pt->id)
+				tr->hw_switches++;
+			t->hw_id = pt->id;
+		}
+
+		out[n].id = t->id;
+		out[n].x = t->x + 0.5f;
+		out[n].y = t->y + 0.5f;
+		n++;
+	}
+
+	return n;
+}
+
+int ft5x06_track_run(int fd, int addr, int chip_id, const char *gpio,
+		     int count, int cpu)
+{
+	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	struct ft5x06_tracked out[FT_TRACK_MAX];
+	struct ft5x06_touch_frame frame;
+	struct ft5x06_tracker tr;
+	struct ft5x06_lat lat;
+	bool edge_events = false;
+	uint64_t edge;
+	int gfd = -1, i, n, ret;
+
+	if (info == NULL || count <= 0)
+		return -EINVAL;
+
+	if (gpio) {
+		gfd = ft5x06_gpio_open(gpio, &edge_events);
+		if (gfd < 0)
+			return gfd;
+	}
+
+	ret = ft5x06_lat_init(&lat, count);
+	if (ret < 0)
+		goto out;
+
+	if (info->tpd_max_points > FT_TRACK_MAX)
+		LOG("Tracking limited to %d of %d points", FT_TRACK_MAX,
+		    info->tpd_max_points);
+	ft5x06_tracker_init(&tr, info->tpd_max_points);
+	/* A busy sampling loop at SCHED_FIFO must not share its CPU */
+	if (gfd < 0 || edge_events || cpu >= 0)
+		ft5x06_rt_setup(cpu);
+	else
+		LOG("Busy sampling without --cpu, not switching to SCHED_FIFO");
+
+	LOG("Tracking %d frames", count);
+	for (i = 0; i < count; i++) {
+		uint64_t start;
+
+		if (gfd >= 0)
+			ret = ft5x06_gpio_wait(gfd, edge_events,
+					       FT_INT_IDLE_MS, &edge);
+		else
+			msleep(10);
+		if (ret < 0)
+			break;
+
+		if (ft5x06_read_touch(fd, addr, &frame,
+				      info->tpd_max_points) < 0)
+			continue;
+
+		start = ft5x06_now_ns();
+		n = ft5x06_tracker_update(&tr, &frame, out);
+		ft5x06_lat_add(&lat, ft5x06_now_ns() - start);
+
+		while (n--)
+			DBG("#%d: id %u @%d,%d", i, out[n].id, out[n].x,
+			    out[n].y);
+	}
+
+	LOG("Frames %u, tracks started %u, ended %u", tr.frames, tr.births,
+	    tr.ends);
+	LOG("Controller ID switches absorbed: %u (%.2f per 1000 frames)",
+	    tr.hw_switches, tr.frames ? tr.hw_switches * 1000.0 / tr.frames : 0);
+	ft5x06_lat_report(&lat, "Tracking cost");
+	ret = 0;
+
+	ft5x06_lat_free(&lat);
+out:
+	if (gfd >= 0)
+		close(gfd);
+	return ret;
+}
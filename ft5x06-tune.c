@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Touch threshold (ID_G_THGROUP/THPEAK/THWATER) auto-tuning
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ft5x06.h"
+
+#define TUNE_IDLE_FRAMES	16
+#define TUNE_TOUCH_MS		3000
+#define TUNE_MAX_FRAMES		512
+#define TUNE_SETTLE_MS		30
+#define TUNE_POLL_MS		5
+/* Raw counts per ID_G_THGROUP unit, see tune_replay() */
+#define TUNE_GROUP_COUNTS	4
+/* Score penalties, in ms of latency, per false touch/s and per missed tap */
+#define TUNE_FALSE_WEIGHT	1000
+#define TUNE_MISS_WEIGHT	1000
+
+/* Order of the registers starting at ID_G_THGROUP */
+#define TUNE_REG_GROUP		0
+#define TUNE_REG_PEAK		1
+#define TUNE_REG_CAL		2
+#define TUNE_REG_WATER		3
+#define TUNE_REG_COUNT		4
+
+/* Per touched frame summary, enough to replay the detection decision */
+struct tune_frame {
+	uint64_t ts;
+	int peak;		/* highest delta against the idle baseline */
+	int prominence;		/* peak minus its neighbours mean */
+};
+
+struct tune_capture {
+	int noise;
+	uint32_t count;
+	struct tune_frame frames[TUNE_MAX_FRAMES];
+};
+
+struct tune_result {
+	uint8_t regs[TUNE_REG_COUNT];
+	double false_rate;	/* false touches per second while idle */
+	double ttfr_ms;		/* modelled mean time to first report */
+	double miss_rate;	/* ratio of taps that never reported */
+	double score;
+};
+
+static int tune_delta(const uint16_t *frame, const int32_t *baseline, int i)
+{
+	int delta = baseline[i] - frame[i];
+
+	return delta < 0 ? -delta : delta;
+}
+
+static int tune_capture(int fd, int addr, struct tune_capture *cap)
+{
+	struct ft5x06_raw_info raw;
+	uint16_t frame[FT_RAW_MAX_TX * FT_RAW_MAX_RX];
+	int32_t baseline[FT_RAW_MAX_TX * FT_RAW_MAX_RX];
+	uint64_t start;
+	int i, j, nodes, ret;
+
+	/* Left by ft5x06_factory_enter() itself when it fails */
+	ret = ft5x06_factory_enter(fd, addr, &raw);
+	if (ret < 0)
+		return ret;
+	nodes = raw.tx * raw.rx;
+
+	LOG("Capturing idle frames, don't touch the panel");
+	memset(baseline, 0, sizeof(baseline));
+	for (i = 0; i < TUNE_IDLE_FRAMES; i++) {
+		ret = ft5x06_raw_read(fd, addr, &raw, frame);
+		if (ret < 0)
+			goto out;
+		for (j = 0; j < nodes; j++)
+			baseline[j] += frame[j];
+	}
+	for (j = 0; j < nodes; j++)
+		baseline[j] /= TUNE_IDLE_FRAMES;
+
+	/* Noise: worst deviation seen on an idle frame */
+	cap->noise = 0;
+	for (i = 0; i < TUNE_IDLE_FRAMES / 2; i++) {
+		ret = ft5x06_raw_read(fd, addr, &raw, frame);
+		if (ret < 0)
+			goto out;
+		for (j = 0; j < nodes; j++)
+			if (tune_delta(frame, baseline, j) > cap->noise)
+				cap->noise = tune_delta(frame, baseline, j);
+	}
+	LOG("Idle noise: %d counts", cap->noise);
+
+	LOG("Tap the panel several times during the next %d ms",
+	    TUNE_TOUCH_MS);
+	cap->count = 0;
+	start = ft5x06_now_ns();
+	while (cap->count < TUNE_MAX_FRAMES &&
+	       ft5x06_now_ns() - start < TUNE_TOUCH_MS * 1000000ull) {
+		struct tune_frame *f = &cap->frames[cap->count];
+		int peak_idx = 0, sum = 0, n = 0, r, c;
+
+		ret = ft5x06_raw_read(fd, addr, &raw, frame);
+		if (ret < 0)
+			goto out;
+		f->ts = ft5x06_now_ns();
+		f->peak = 0;
+		for (j = 0; j < nodes; j++) {
+			if (tune_delta(frame, baseline, j) > f->peak) {
+				f->peak = tune_delta(frame, baseline, j);
+				peak_idx = j;
+			}
+		}
+
+		r = peak_idx / raw.rx;
+		c = peak_idx % raw.rx;
+		if (r > 0) {
+			sum += tune_delta(frame, baseline, peak_idx - raw.rx);
+			n++;
+		}
+		if (r < raw.tx - 1) {
+			sum += tune_delta(frame, baseline, peak_idx + raw.rx);
+			n++;
+		}
+		if (c > 0) {
+			sum += tune_delta(frame, baseline, peak_idx - 1);
+			n++;
+		}
+		if (c < raw.rx - 1) {
+			sum += tune_delta(frame, baseline, peak_idx + 1);
+			n++;
+		}
+		f->prominence = f->peak - (n ? sum / n : 0);
+		cap->count++;
+	}
+	LOG("Captured %u touched frames", cap->count);
+	ret = 0;
+out:
+	ft5x06_factory_exit(fd, addr);
+	return ret;
+}
+
+/*
+ * Estimates time to first report and missed taps from the touched
+ * capture, the firmware detection can't be observed while raw frames are
+ * read. Every tap starts on the first frame rising above the idle noise
+ * band. The candidate is modelled as reporting once the peak reaches the
+ * touch threshold with at least THPEAK of prominence. FocalTech's
+ * register notes give that threshold as 4 times the ID_G_THGROUP value.
+ * The model hasn't been checked against every family's firmware, so
+ * these terms are estimates and printed as such. Only the false touch
+ * rate is measured against the controller. THWATER only matters with
+ * water on the glass, so the idle measurement alone scores it.
+ */
+static void tune_replay(const struct tune_capture *cap,
+			struct tune_result *res)
+{
+	int band = cap->noise * 3 + 1;
+	int group = TUNE_GROUP_COUNTS * res->regs[TUNE_REG_GROUP];
+	int peak = res->regs[TUNE_REG_PEAK];
+	uint32_t i = 0, taps = 0, missed = 0;
+	uint64_t total = 0;
+
+	while (i < cap->count) {
+		uint64_t onset;
+		bool reported = false;
+
+		if (cap->frames[i].peak < band) {
+			i++;
+			continue;
+		}
+
+		taps++;
+		onset = cap->frames[i].ts;
+		for (; i < cap->count && cap->frames[i].peak >= band; i++) {
+			if (reported || cap->frames[i].peak < group ||
+			    cap->frames[i].prominence < peak)
+				continue;
+			reported = true;
+			total += cap->frames[i].ts - onset;
+		}
+		if (!reported)
+			missed++;
+	}
+
+	res->miss_rate = taps ? (double)missed / taps : 1.0;
+	res->ttfr_ms = (taps > missed) ? total / 1e6 / (taps - missed) : 0;
+}
+
+static int tune_apply(int fd, int addr, const uint8_t *regs)
+{
+	uint8_t check[TUNE_REG_COUNT];
+	int i, ret = -EIO;
+
+	/* Burst write then read back, controllers ignore out of range values */
+	for (i = 0; i < FT_MAX_TRIES; i++) {
+		ft5x06_write_regs(fd, addr, ID_G_THGROUP, regs, TUNE_REG_COUNT);
+		ret = ft5x06_read_regs(fd, addr, ID_G_THGROUP, check,
+				       TUNE_REG_COUNT);
+		if (ret >= 0 && memcmp(check, regs, TUNE_REG_COUNT) == 0)
+			return 0;
+		msleep(FT_RETRY_DLY);
+	}
+
+	if (ret < 0) {
+		ERR("Couldn't read back the thresholds: %d", ret);
+		return ret;
+	}
+	ERR("Verification failed: %02x %02x %02x", check[TUNE_REG_GROUP],
+	    check[TUNE_REG_PEAK], check[TUNE_REG_WATER]);
+	return -EIO;
+}
+
+/* Counts touch reports showing up while nobody touches the panel */
+static double tune_idle_false_rate(int fd, int addr, int window_ms)
+{
+	uint64_t start, end;
+	uint8_t status;
+	bool touched = false;
+	int reports = 0;
+
+	msleep(TUNE_SETTLE_MS);
+	start = ft5x06_now_ns();
+	end = start + window_ms * 1000000ull;
+	while (ft5x06_now_ns() < end) {
+		if (ft5x06_read_regs(fd, addr, ID_G_TD_STATUS, &status,
+				     1) >= 0) {
+			bool now = (status & 0x0f) != 0;
+
+			if (now && !touched)
+				reports++;
+			touched = now;
+		}
+		msleep(TUNE_POLL_MS);
+	}
+
+	return reports * 1000.0 / window_ms;
+}
+
+static uint8_t tune_scale(uint8_t value, int pct)
+{
+	int scaled = value * pct / 100;
+
+	if (scaled < 1)
+		return 1;
+	if (scaled > 0xff)
+		return 0xff;
+	return scaled;
+}
+
+int ft5x06_tune(int fd, int addr, int chip_id, int window_ms, bool apply)
+{
+	static const int group_pct[] = { 50, 75, 100, 125, 150 };
+	static const int peak_pct[] = { 75, 100, 125 };
+	static const int water_pct[] = { 100, 150 };
+	struct tune_capture *cap;
+	struct tune_result *results, *best = NULL;
+	uint8_t defaults[TUNE_REG_COUNT];
+	uint64_t start;
+	int i, total, n = 0, ret;
+
+	ret = ft5x06_read_regs(fd, addr, ID_G_THGROUP, defaults,
+			       TUNE_REG_COUNT);
+	if (ret < 0)
+		return ret;
+	LOG("Current THGROUP %d THPEAK %d THWATER %d",
+	    defaults[TUNE_REG_GROUP], defaults[TUNE_REG_PEAK],
+	    defaults[TUNE_REG_WATER]);
+
+	cap = malloc(sizeof(*cap));
+	total = ARRAY_SIZE(group_pct) * ARRAY_SIZE(peak_pct) *
+		ARRAY_SIZE(water_pct);
+	results = calloc(total, sizeof(*results));
+	if (!cap || !results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = tune_capture(fd, addr, cap);
+	if (ret < 0)
+		goto out;
+
+	LOG("Scoring candidates, don't touch the panel");
+	start = ft5x06_now_ns();
+	for (i = 0; i < total; i++) {
+		struct tune_result *res = &results[n];
+		int w = i % ARRAY_SIZE(water_pct);
+		int p = (i / ARRAY_SIZE(water_pct)) % ARRAY_SIZE(peak_pct);
+		int g = i / ARRAY_SIZE(water_pct) / ARRAY_SIZE(peak_pct);
+
+		memcpy(res->regs, defaults, TUNE_REG_COUNT);
+		res->regs[TUNE_REG_GROUP] =
+			tune_scale(defaults[TUNE_REG_GROUP], group_pct[g]);
+		res->regs[TUNE_REG_PEAK] =
+			tune_scale(defaults[TUNE_REG_PEAK], peak_pct[p]);
+		res->regs[TUNE_REG_WATER] =
+			tune_scale(defaults[TUNE_REG_WATER], water_pct[w]);
+
+		if (tune_apply(fd, addr, res->regs) < 0)
+			continue;
+
+		res->false_rate = tune_idle_false_rate(fd, addr, window_ms);
+		tune_replay(cap, res);
+		res->score = res->false_rate * TUNE_FALSE_WEIGHT +
+			     res->miss_rate * TUNE_MISS_WEIGHT + res->ttfr_ms;
+		LOG("THGROUP %3d THPEAK %3d THWATER %3d: %.2f false/s, "
+		    "modelled ttfr %.1f ms, %.0f%% missed, score %.1f",
+		    res->regs[TUNE_REG_GROUP], res->regs[TUNE_REG_PEAK],
+		    res->regs[TUNE_REG_WATER], res->false_rate, res->ttfr_ms,
+		    res->miss_rate * 100, res->score);
+
+		if (!best || res->score < best->score)
+			best = res;
+		n++;
+	}
+	LOG("%d candidates in %.1f s", n, (ft5x06_now_ns() - start) / 1e9);
+	LOG("False touches measured, ttfr and missed taps modelled from the "
+	    "raw capture");
+
+	if (!best) {
+		ret = -EIO;
+		goto restore;
+	}
+
+	LOG("Best profile: THGROUP %d THPEAK %d THWATER %d (score %.1f)",
+	    best->regs[TUNE_REG_GROUP], best->regs[TUNE_REG_PEAK],
+	    best->regs[TUNE_REG_WATER], best->score);
+	if (apply) {
+		ret = tune_apply(fd, addr, best->regs);
+		goto out;
+	}
+
+restore:
+	tune_apply(fd, addr, defaults);
+out:
+	free(results);
+	free(cap);
+	return ret;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Touch reads scheduled to complete just before the display vblank
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "ft5x06.h"
+
+#define VB_DEFAULT_HZ		60
+#define VB_READ_EST_NS		1000000	/* until measured */
+
+/* From the kernel DRM uapi (drm.h), libdrm headers aren't needed */
+#define VB_DRM_VBLANK_RELATIVE		0x00000001
+#define VB_DRM_VBLANK_EVENT		0x04000000
+#define VB_DRM_VBLANK_SECONDARY		0x20000000
+#define VB_DRM_VBLANK_HIGH_CRTC_SHIFT	1
+#define VB_DRM_VBLANK_HIGH_CRTC_MASK	0x0000003e
+#define VB_DRM_EVENT_VBLANK		0x01
+
+struct vb_drm_wait_vblank_request {
+	uint32_t type;
+	uint32_t sequence;
+	unsigned long signal;
+};
+
+struct vb_drm_wait_vblank_reply {
+	uint32_t type;
+	uint32_t sequence;
+	long tval_sec;
+	long tval_usec;
+};
+
+union vb_drm_wait_vblank {
+	struct vb_drm_wait_vblank_request request;
+	struct vb_drm_wait_vblank_reply reply;
+};
+
+struct vb_drm_event_vblank {
+	uint32_t type;
+	uint32_t length;
+	uint64_t user_data;
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint32_t sequence;
+	uint32_t crtc_id;
+};
+
+#define VB_DRM_IOCTL_WAIT_VBLANK \
+	_IOWR('d', 0x3a, union vb_drm_wait_vblank)
+
+/* DRM vblank events or, without a usable card, a free running timer */
+struct vb_source {
+	int fd;
+	uint32_t crtc_type;
+	uint64_t timer_ns;
+	uint64_t period_ns;
+	uint32_t seq;
+};
+
+static int vb_open(struct vb_source *vb, const char *spec, int hz)
+{
+	char path[64];
+	const char *sep = strchr(spec, ':');
+	int crtc = sep ? strtol(sep + 1, NULL, 10) : 0;
+
+	if (hz <= 0)
+		hz = VB_DEFAULT_HZ;
+	vb->fd = -1;
+	vb->period_ns = 1000000000ull / hz;
+	if (strcmp(spec, "timer") == 0)
+		return 0;
+
+	snprintf(path, sizeof(path), "%.*s", sep ? (int)(sep - spec) :
+		 (int)strlen(spec), spec);
+	vb->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (vb->fd < 0) {
+		ERR("Couldn't open %s: %s, using a %d Hz timer", path,
+		    strerror(errno), hz);
+		return 0;
+	}
+
+	if (crtc == 1)
+		vb->crtc_type = VB_DRM_VBLANK_SECONDARY;
+	else if (crtc > 1)
+		vb->crtc_type = (crtc << VB_DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				VB_DRM_VBLANK_HIGH_CRTC_MASK;
+	LOG("Vblank events from %s, CRTC %d", path, crtc);
+
+	return 0;
+}
+
+/* Asks for an event on the next vblank, the read comes later */
+static int vb_queue(struct vb_source *vb)
+{
+	union vb_drm_wait_vblank wv;
+
+	if (vb->fd < 0)
+		return 0;
+
+	memset(&wv, 0, sizeof(wv));
+	wv.request.type = VB_DRM_VBLANK_RELATIVE | VB_DRM_VBLANK_EVENT |
+			  vb->crtc_type;
+	wv.request.sequence = 1;
+	if (ioctl(vb->fd, VB_DRM_IOCTL_WAIT_VBLANK, &wv) < 0) {
+		ERR("Vblank request failed: %s, using a timer",
+		    strerror(errno));
+		close(vb->fd);
+		vb->fd = -1;
+	}
+
+	return 0;
+}
+
+/* Blocks until the vblank, returns its CLOCK_MONOTONIC timestamp */
+static int vb_wait(struct vb_source *vb, uint64_t *ns, uint32_t *seq)
+{
+	struct vb_drm_event_vblank ev;
+	struct timespec ts;
+
+	if (vb->fd < 0) {
+		uint64_t now = ft5x06_now_ns();
+
+		if (!vb->timer_ns)
+			vb->timer_ns = now;
+		while (vb->timer_ns <= now) {
+			vb->timer_ns += vb->period_ns;
+			vb->seq++;
+		}
+		ts.tv_sec = vb->timer_ns / 1000000000ull;
+		ts.tv_nsec = vb->timer_ns % 1000000000ull;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		*ns = vb->timer_ns;
+		*seq = vb->seq;
+		return 0;
+	}
+
+	/* A vblank event is the only thing read from the card */
+	for (;;) {
+		ssize_t len = read(vb->fd, &ev, sizeof(ev));
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < (ssize_t)sizeof(ev))
+			return len < 0 ? -errno : -EIO;
+		if (ev.type == VB_DRM_EVENT_VBLANK)
+			break;
+	}
+	*ns = ev.tv_sec * 1000000000ull + ev.tv_usec * 1000ull;
+	*seq = ev.sequence;
+
+	return 0;
+}
+
+static void vb_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR)
+		;
+}
+
+/*
+ * Predicts the next vblank from the last one and the measured period,
+ * then starts the burst read so that it completes margin_us before it.
+ * The read duration is learned as it goes. Data age at vblank is counted
+ * from the read completion, the controller scan itself adds to it.
+ */
+int ft5x06_vblank_run(int fd, int addr, int chip_id, const char *card,
+		      int hz, int margin_us, int count, int cpu)
+{
+	struct ft5x06_fw_update_info *info = ft5x06_get_info(chip_id);
+	struct ft5x06_lat lat_age, lat_pred, lat_read;
+	struct ft5x06_touch_frame frame;
+	struct vb_source vb = { 0 };
+	uint64_t last_ns = 0, read_est = VB_READ_EST_NS, period;
+	uint32_t last_seq = 0, misses = 0, skipped = 0, contacts = 0;
+	int i, ret;
+
+	if (info == NULL || count <= 0 || margin_us < 0)
+		return -EINVAL;
+
+	ret = vb_open(&vb, card, hz);
+	if (ret < 0)
+		return ret;
+	period = vb.period_ns;
+
+	ft5x06_lat_init(&lat_age, count);
+	ft5x06_lat_init(&lat_pred, count);
+	ft5x06_lat_init(&lat_read, count);
+	ft5x06_rt_setup(cpu);
+
+	/* First vblank only sets the phase */
+	vb_queue(&vb);
+	ret = vb_wait(&vb, &last_ns, &last_seq);
+
+	/* Held throughout, arbitration isn't part of the measured path */
+	ft5x06_bus_lock(fd);
+	LOG("Sampling %d vblanks, %d us margin", count, margin_us);
+	for (i = 0; i < count && ret == 0; i++) {
+		uint64_t predicted = last_ns + period, start, done, vblank;
+		uint64_t target = predicted - margin_us * 1000ull - read_est;
+		uint64_t t = ft5x06_trace_start();
+		uint32_t seq;
+
+		vb_queue(&vb);
+		if (target > ft5x06_now_ns())
+			vb_sleep_until(target);
+		else
+			skipped++;
+		ft5x06_trace_span("vblank margin sleep", t, NULL);
+
+		start = ft5x06_now_ns();
+		if (ft5x06_read_touch(fd, addr, &frame,
+				      info->tpd_max_points) > 0)
+			contacts++;
+		done = frame.ts;
+		ft5x06_lat_add(&lat_read, done - start);
+		read_est += ((int64_t)(done - start) - (int64_t)read_est) / 8;
+
+		ret = vb_wait(&vb, &vblank, &seq);
+		if (ret < 0)
+			break;
+		ft5x06_trace_span("frame", last_ns, "\"vblank\":%u", seq);
+
+		if (done <= vblank)
+			ft5x06_lat_add(&lat_age, vblank - done);
+		else
+			misses++;
+		ft5x06_lat_add(&lat_pred, vblank > predicted ?
+			       vblank - predicted : predicted - vblank);
+
+		/* Period from the vblank sequence, immune to missed ones */
+		if (seq > last_seq && seq - last_seq < 8)
+			period += ((int64_t)(vblank - last_ns) /
+				   (seq - last_seq) - (int64_t)period) / 8;
+		last_ns = vblank;
+		last_seq = seq;
+	}
+	ft5x06_bus_unlock(fd);
+
+	LOG("Vblank period %.3f ms (%.2f Hz), %s", period / 1e6, 1e9 / period,
+	    vb.fd >= 0 ? "DRM events" : "timer");
+	LOG("Frames with contacts %u, reads after vblank %u, "
+	    "late schedules %u", contacts, misses, skipped);
+	ft5x06_lat_report(&lat_read, "Burst read");
+	ft5x06_lat_report(&lat_pred, "Vblank prediction error");
+	ft5x06_lat_report(&lat_age, "Data age at vblank");
+
+	ft5x06_lat_free(&lat_age);
+	ft5x06_lat_free(&lat_pred);
+	ft5x06_lat_free(&lat_read);
+	if (vb.fd >= 0)
+		close(vb.fd);
+	return ret;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2017, Boundary Devices <info@boundarydevices.com>
+ *
+ * SPDX-License-Identifier:      GPL-2.0+
+ *
+ * Definitions shared by the ft5x06-tool modules
+ */
+
+#ifndef FT5X06_H
+#define FT5X06_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Documented registers */
+#define ID_G_DEVICE_MODE	0x00
+#define ID_G_GEST_ID		0x01
+#define ID_G_TD_STATUS		0x02
+#define ID_G_TOUCH1_XH		0x03
+#define ID_G_THGROUP		0x80
+#define ID_G_THPEAK		0x81
+#define ID_G_THCAL		0x82
+#define ID_G_THWATER		0x83
+#define ID_G_THTEMP		0x84
+#define ID_G_CTRL		0x86
+#define ID_G_TIME_ENTER_MONITOR	0x87
+#define ID_G_PERIODACTIVE	0x88
+#define ID_G_PERIODMONITOR	0x89
+#define ID_G_AUTO_CLB_MODE	0xa0
+#define ID_G_LIB_VERSION_H	0xa1
+#define ID_G_LIB_VERSION_L	0xa2
+#define ID_G_CIPHER		0xa3
+#define ID_G_MODE		0xa4
+#define ID_G_FIRMID		0xa6
+#define ID_G_FT5201ID		0xa8
+#define ID_G_ERR		0xa9
+#define ID_G_CLB		0xaa
+#define ID_G_B_AREA_TH		0xae
+#define FT5x06_MAX_REG_OFFSET	0xae
+
+/* Undocumented registers */
+#define FT_FW_READ_REG		0x03
+#define FT_REG_RESET_FW		0x07
+#define FT_ERASE_APP_REG	0x61
+#define FT_ERASE_PANEL_REG	0x63
+#define FT_FLASH_STATUS		0x6a
+#define FT_PARAM_READ_REG	0x85
+#define FT_READ_ID_REG		0x90
+#define FT_FW_START_REG		0xbf
+#define FT_REG_ECC		0xcc
+#define FT_RST_CMD_REG1		0xfc
+
+/* Undocumented firmware update values */
+#define FT_UPGRADE_AA		0xAA
+#define FT_UPGRADE_55		0x55
+#define FT_UPGRADE_LOOP		30
+#define FT_FLASH_ERASE_DONE	0xf0aa
+#define FT_ERASE_POLL_MIN_MS	10
+#define FT_ERASE_POLL_MAX_MS	50
+#define FT_FW_MIN_SIZE		8
+#define FT_FW_MAX_SIZE		64*1024
+#define FT_FW_NAME_MAX_LEN	50
+#define FT_MAX_TRIES		5
+#define FT_RETRY_DLY		20
+#define FT_MAX_WR_BUF		10
+#define FT_MAX_RD_BUF		2
+#define FT_FW_PKT_LEN		128
+#define FT_FW_PKT_READ_LEN	256
+#define FT_FW_PKT_META_LEN	6
+#define FT_FW_PKT_DLY_MS	20
+#define FT_FW_STREAM_CHUNK	4096
+
+/* Touch report layout (work mode) */
+#define FT_MAX_POINTS		10
+#define FT_TOUCH_POINT_LEN	6
+#define FT_TOUCH_EVENT_DOWN	0
+#define FT_TOUCH_EVENT_UP	1
+#define FT_TOUCH_EVENT_CONTACT	2
+#define FT_TOUCH_EVENT_NONE	3
+#define FT_INT_IDLE_MS		30000	/* no touch that long ends a run */
+
+/* Factory mode (raw data) layout */
+#define FT_MODE_WORK		0x00
+#define FT_MODE_FACTORY		0x40
+#define FT_MODE_START_SCAN	0x80
+#define FT_FACTORY_ROW_ADDR	0x01
+#define FT_FACTORY_TX_NUM	0x02
+#define FT_FACTORY_RX_NUM	0x03
+#define FT_FACTORY_RAW_DATA	0x10
+#define FT_FACTORY_TRIES	10
+#define FT_RAW_MAX_TX		32
+#define FT_RAW_MAX_RX		32
+
+/* Chip ID that we consider correct */
+#define FT5x06_ID	0x55
+#define FT5x16_ID	0x0a
+#define FT5x26_ID	0x54
+
+/* Print macros */
+#define LOG(fmt, arg...) fprintf(stdout, "[%s]: " fmt "\n" , __func__ , ## arg)
+#define ERR(fmt, arg...) fprintf(stderr, "[%s]: " fmt "\n" , __func__ , ## arg)
+#ifndef DEBUG
+#define DBG(fmt, arg...) {}
+#else
+#define DBG(fmt, arg...) fprintf(stdout, "[%s]: " fmt "\n" , __func__ , ## arg)
+#endif
+
+static inline void msleep(int delay) { usleep(delay*1000); }
+
+static inline uint64_t ft5x06_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct i2c_rdwr_ioctl_data;
+
+/* Bus transaction backend, the i2c-dev ioctl being the default one */
+struct ft5x06_transport {
+	const char *name;
+	int (*xfer)(void *priv, int fd, struct i2c_rdwr_ioctl_data *data);
+	void *priv;
+};
+
+enum ft5x06_fault_type {
+	FT_FAULT_NAK,
+	FT_FAULT_SHORT,
+	FT_FAULT_DELAY,
+	FT_FAULT_CORRUPT,
+	FT_FAULT_TYPES,
+};
+
+struct ft5x06_ts {
+	int fd;
+	uint8_t addr;
+	uint8_t chip_id;
+	uint8_t	fw_ver;
+};
+
+struct ft5x06_fw_update_info {
+	uint8_t chip_id;
+	char fts_name[20];
+	uint8_t tpd_max_points;
+	uint8_t auto_clb;
+	uint16_t delay_aa;		/*delay of write FT_UPGRADE_AA */
+	uint16_t delay_55;		/*delay of write FT_UPGRADE_55 */
+	uint8_t upgrade_id_1;		/*upgrade id 1 */
+	uint8_t upgrade_id_2;		/*upgrade id 2 */
+	uint16_t delay_readid;		/*delay of read id */
+	uint16_t delay_erase_flash;	/*delay of erase flash*/
+	uint32_t flash_offset;
+	uint8_t addr_width;		/*flash offset bytes in packets*/
+	uint32_t fw_max_size;		/*flash size*/
+};
+
+struct ft5x06_session {
+	int fd;
+	int addr;
+	int chip_id;
+	struct ft5x06_fw_update_info *info;
+	struct ft5x06_fw_update_info family;	/* flash size overridden */
+	bool active;
+	uint64_t trace_ns;
+	uint8_t ecc;		/* of the data written since the erase */
+};
+
+enum ft5x06_job_type {
+	FT_JOB_DUMP,
+	FT_JOB_ERASE,
+	FT_JOB_PROGRAM,
+	FT_JOB_VERIFY,
+	FT_JOB_PARAM,
+};
+
+struct ft5x06_job {
+	enum ft5x06_job_type type;
+	const char *path;
+	uint32_t offset;
+	int ret;
+	uint64_t ns;
+};
+
+#define FT_JOB_MAX	16
+
+struct ft5x06_touch_point {
+	uint16_t x;
+	uint16_t y;
+	uint8_t id;
+	uint8_t event;
+	uint8_t weight;
+	uint8_t area;
+};
+
+struct ft5x06_touch_frame {
+	uint64_t ts;		/* CLOCK_MONOTONIC, read completion */
+	uint8_t count;
+	struct ft5x06_touch_point p[FT_MAX_POINTS];
+};
+
+/* Tracker size, bounded by the permutation table of its solver */
+#define FT_TRACK_MAX	5
+
+struct ft5x06_track {
+	bool active;
+	uint16_t id;		/* stable ID reported to the user */
+	uint8_t hw_id;		/* controller ID last associated */
+	float x, y;		/* smoothed position */
+	float vx, vy;		/* velocity, pixels per ms */
+};
+
+struct ft5x06_tracker {
+	int max;
+	uint16_t next_id;
+	uint64_t last_ts;
+	uint32_t frames;
+	uint32_t births;
+	uint32_t ends;
+	uint32_t hw_switches;
+	struct ft5x06_track t[FT_TRACK_MAX];
+};
+
+struct ft5x06_tracked {
+	uint16_t id;
+	uint16_t x;
+	uint16_t y;
+};
+
+struct ft5x06_raw_info {
+	uint8_t tx;
+	uint8_t rx;
+};
+
+enum ft5x06_async_op {
+	FT_ASYNC_DETECT,
+	FT_ASYNC_READ_REG,
+	FT_ASYNC_DUMP,
+	FT_ASYNC_FLASH,
+};
+
+/* Progress while running, then once with complete set */
+struct ft5x06_async_event {
+	enum ft5x06_async_op op;
+	const char *stage;	/* enter, erase, program, verify, dump, reset */
+	uint32_t done;		/* bytes */
+	uint32_t total;
+	bool complete;
+	int ret;
+	uint8_t value;		/* register read, firmware version on detect */
+	int chip_id;		/* detect */
+};
+
+struct ft5x06_async;
+typedef void (*ft5x06_async_cb)(struct ft5x06_async *a,
+				const struct ft5x06_async_event *ev,
+				void *priv);
+
+/* ft5x06-tool.c */
+void ft5x06_set_transport(const struct ft5x06_transport *t);
+const struct ft5x06_transport *ft5x06_get_transport(void);
+int ft5x06_transport_xfer(const struct ft5x06_transport *t, int fd,
+			  struct i2c_rdwr_ioctl_data *data);
+int ft5x06_i2c_read(int fd, int addr, uint8_t *wrbuf, uint16_t wrlen,
+		    uint8_t *rdbuf, uint16_t rdlen);
+int ft5x06_i2c_write(int fd, int addr, uint8_t *buf, uint16_t len);
+void ft5x06_write_reg(int fd, int addr, uint8_t regnum, uint8_t value);
+int ft5x06_read_regs(int fd, int addr, uint8_t regnum, uint8_t *buf,
+		     uint16_t len);
+int ft5x06_write_regs(int fd, int addr, uint8_t regnum, const uint8_t *buf,
+		      uint16_t len);
+char *ft5x06_get_name(unsigned chip_id);
+struct ft5x06_fw_update_info *ft5x06_get_info(unsigned chip_id);
+void ft5x06_set_flash_size(uint32_t size);
+int ft5x06_get_flash_info(unsigned chip_id,
+			  struct ft5x06_fw_update_info *info);
+int ft5x06_session_begin(struct ft5x06_session *s, int fd, int addr,
+			 int chip_id);
+void ft5x06_session_end(struct ft5x06_session *s);
+int ft5x06_session_dump(struct ft5x06_session *s, int outfd, uint32_t size);
+int ft5x06_session_erase(struct ft5x06_session *s);
+int ft5x06_session_program(struct ft5x06_session *s, const uint8_t *data,
+			   uint32_t data_len);
+int ft5x06_session_program_fd(struct ft5x06_session *s, int fd,
+			      uint32_t data_len);
+int ft5x06_session_param_fd(struct ft5x06_session *s, uint32_t offset,
+			    int fd, uint32_t data_len);
+int ft5x06_session_verify(struct ft5x06_session *s);
+void ft5x06_fw_put_offset(uint8_t *buf, uint32_t offset, int addr_width);
+bool ft5x06_erase_done(int fd, int addr);
+int ft5x06_fw_read(int fd, int addr, int chip_id, int outfd);
+int ft5x06_fw_upgrade(int fd, int addr, int chip_id,
+		      const uint8_t *data, uint32_t data_len);
+
+/* ft5x06-touch.c */
+int ft5x06_read_touch(int fd, int addr, struct ft5x06_touch_frame *frame,
+		      int max_points);
+int ft5x06_gpio_open(const char *spec, bool *edge_events);
+int ft5x06_gpio_wait(int gfd, bool edge_events, int timeout_ms,
+		     uint64_t *edge_ns);
+
+/* ft5x06-raw.c */
+int ft5x06_factory_enter(int fd, int addr, struct ft5x06_raw_info *raw);
+int ft5x06_factory_exit(int fd, int addr);
+int ft5x06_raw_read(int fd, int addr, const struct ft5x06_raw_info *raw,
+		    uint16_t *frame);
+int ft5x06_raw_read_bulk(int fd, int addr, const struct ft5x06_raw_info *raw,
+			 uint16_t *frame);
+
+/* ft5x06-job.c */
+int ft5x06_job_parse(char *spec, struct ft5x06_job *jobs, int max);
+int ft5x06_job_run(int fd, int addr, int chip_id, struct ft5x06_job *jobs,
+		   int count);
+
+/* ft5x06-lock.c */
+int ft5x06_bus_lock_register(int fd, int bus);
+void ft5x06_bus_lock(int fd);
+int ft5x06_bus_trylock(int fd);
+void ft5x06_bus_unlock(int fd);
+void ft5x06_bus_lock_report(void);
+
+/* ft5x06-perf.c */
+struct ft5x06_lat {
+	uint64_t *ns;
+	uint32_t count;
+	uint32_t size;
+};
+
+int ft5x06_lat_init(struct ft5x06_lat *lat, uint32_t size);
+void ft5x06_lat_free(struct ft5x06_lat *lat);
+void ft5x06_lat_report(struct ft5x06_lat *lat, const char *name);
+int ft5x06_rt_setup(int cpu);
+
+static inline void ft5x06_lat_add(struct ft5x06_lat *lat, uint64_t ns)
+{
+	if (lat->count < lat->size)
+		lat->ns[lat->count++] = ns;
+}
+
+/* ft5x06-bench.c */
+int ft5x06_bench_evdev(int fd, int addr, int chip_id, const char *evdev,
+		       const char *gpio, int count, int cpu);
+int ft5x06_bench_flash(int fd, int addr, int chip_id);
+
+/* ft5x06-track.c */
+void ft5x06_tracker_init(struct ft5x06_tracker *tr, int max_points);
+int ft5x06_tracker_update(struct ft5x06_tracker *tr,
+			  const struct ft5x06_touch_frame *frame,
+			  struct ft5x06_tracked *out);
+int ft5x06_track_run(int fd, int addr, int chip_id, const char *gpio,
+		     int count, int cpu);
+
+/* ft5x06-emul.c */
+int ft5x06_emul_init(int chip_id);
+const uint8_t *ft5x06_emul_flash(uint32_t *len);
+void ft5x06_emul_taps(bool enable);
+uint64_t ft5x06_emul_touch_down_ns(void);
+
+/* ft5x06-fault.c */
+int ft5x06_fault_parse(const char *spec, double *rates);
+int ft5x06_fault_init(const double *rates);
+int ft5x06_fault_bench(int fd, int addr, int chip_id, const uint8_t *img,
+		       uint32_t len, const double *rates);
+
+/* ft5x06-capture.c */
+int ft5x06_capture(int fd, int addr, const char *path, int count);
+int ft5x06_capture_info(const char *path, int frame);
+
+/* ft5x06-selftest.c */
+int ft5x06_selftest(int fd, int addr, const char *limits);
+
+/* ft5x06-poll.c */
+int ft5x06_poll_run(int fd, int addr, int chip_id, int seconds, int idle_ms,
+		    int cpu, uint64_t (*onset_ns)(void));
+
+/* ft5x06-trace.c */
+extern bool ft5x06_tracing;
+
+int ft5x06_trace_open(const char *path, const char *track);
+void ft5x06_trace_close(void);
+void ft5x06_trace_meta(const char *type, const char *name);
+void ft5x06_trace_span(const char *name, uint64_t start_ns,
+		       const char *args, ...);
+
+/* Start of a span, 0 (nothing recorded) when not tracing */
+static inline uint64_t ft5x06_trace_start(void)
+{
+	return ft5x06_tracing ? ft5x06_now_ns() : 0;
+}
+
+/* ft5x06-ktrace.c */
+int ft5x06_ktrace_start(int bus);
+void ft5x06_ktrace_report(void);
+
+/* ft5x06-pm.c */
+int ft5x06_pm_pin(int bus);
+void ft5x06_pm_restore(void);
+int ft5x06_pm_bench(int fd, int addr, int bus, int count);
+
+/* ft5x06-async.c */
+struct ft5x06_async *ft5x06_async_new(int fd, int addr, ft5x06_async_cb cb,
+				      void *priv);
+void ft5x06_async_free(struct ft5x06_async *a);
+int ft5x06_async_fd(struct ft5x06_async *a);
+int ft5x06_async_timeout_ms(struct ft5x06_async *a);
+int ft5x06_async_dispatch(struct ft5x06_async *a);
+int ft5x06_async_detect(struct ft5x06_async *a);
+int ft5x06_async_read_reg(struct ft5x06_async *a, uint8_t reg);
+int ft5x06_async_dump(struct ft5x06_async *a, int chip_id, int outfd,
+		      uint32_t size);
+int ft5x06_async_flash(struct ft5x06_async *a, int chip_id,
+		       const uint8_t *img, uint32_t len);
+int ft5x06_async_run(int fd, int addr, int chip_id, const char *input,
+		     const char *output);
+
+/* ft5x06-batch.c */
+int ft5x06_batch_run(const char *path, int fd, int bus, int addr,
+		     int chip_id);
+
+/* ft5x06-merge.c */
+int ft5x06_merge_run(int fd, int addr, int chip_id, const char *gpio,
+		     const char *tile, const char *tile_gpio,
+		     const char *offset, int seam, int count, int cpu);
+
+/* ft5x06-vblank.c */
+int ft5x06_vblank_run(int fd, int addr, int chip_id, const char *card,
+		      int hz, int margin_us, int count, int cpu);
+
+/* ft5x06-tune.c */
+int ft5x06_tune(int fd, int addr, int chip_id, int window_ms, bool apply);
+
+#endif /* FT5X06_H */